@@ -1,122 +1,503 @@
 #pragma once
 
 #include <utils/barrier.hh>
+#include <utils/parker.hh>
+#include <utils/histogram.hh>
 #include <utils/exception.hh>
 #include <utils/constants.hh>
+#include <utils/locked_queue.hh>
+#include <utils/mpmc_ring.hh>
+#include <utils/work_stealing_queue.hh>
 
-#include <queue>
 #include <thread>
-#include <condition_variable>
-#include <mutex>
 #include <chrono>
 #include <functional>
 #include <vector>
 #include <atomic>
+#include <memory>
+#include <deque>
+#include <mutex>
 #include <algorithm>
+#include <iterator>
 #include <iostream>
+#include <type_traits>
 
 namespace virtdb { namespace utils {
 
-  template <typename ITEM, unsigned long WAKEUP_FREQ=DEFAULT_TIMEOUT_MS>
+  // what push() does when a bounded active_queue is full
+  enum class queue_overflow
+  {
+    block,        // wait for space, up to block_timeout_ms_
+    reject,       // return false immediately
+    drop_oldest,  // discard the oldest queued item to make room
+  };
+  
+  struct active_queue_options
+  {
+    size_t                  capacity_;          // 0 means unbounded
+    queue_overflow          overflow_;
+    uint64_t                block_timeout_ms_;
+    // items pushed with a higher priority are dequeued first. with
+    // lane_weights_ set, lane i is served lane_weights_[i] items in turn
+    // instead of strict priority order
+    unsigned int            n_lanes_;
+    std::vector<unsigned>   lane_weights_;
+    // push_keyed() hashes the keys to this many strands, 0 means four
+    // strands per worker
+    size_t                  n_strands_;
+    // with max_threads_ above the constructor's nthreads the pool grows
+    // when more than grow_depth_ items wait per worker. workers above
+    // nthreads retire after idle_ms_ without work.
+    unsigned int            max_threads_;
+    size_t                  grow_depth_;
+    uint64_t                idle_ms_;
+    // start the workers on the first push instead of in the constructor
+    bool                    lazy_start_;
+    
+    explicit active_queue_options(size_t capacity=0,
+                                  queue_overflow overflow=queue_overflow::block,
+                                  uint64_t block_timeout_ms=DEFAULT_TIMEOUT_MS)
+    : capacity_(capacity),
+      overflow_(overflow),
+      block_timeout_ms_(block_timeout_ms),
+      n_lanes_(1),
+      n_strands_(0),
+      max_threads_(0),
+      grow_depth_(16),
+      idle_ms_(10*DEFAULT_TIMEOUT_MS),
+      lazy_start_(false) {}
+  };
+  
+  // point in time view of an active_queue. the histograms and the worker
+  // times are only filled by instrumented queues, times are in usec.
+  struct active_queue_stats
+  {
+    struct worker_stats
+    {
+      uint64_t   busy_us_;     // time spent in the handler
+      uint64_t   idle_us_;     // time spent parked
+      uint64_t   n_handled_;
+      
+      double busy_ratio() const
+      {
+        uint64_t total = busy_us_ + idle_us_;
+        return total ? static_cast<double>(busy_us_)/total : 0.0;
+      }
+    };
+    
+    uint64_t                    n_enqueued_;
+    uint64_t                    n_done_;
+    uint64_t                    n_dropped_;
+    uint64_t                    n_exceptions_;
+    size_t                      size_;
+    size_t                      high_water_mark_;
+    unsigned int                n_threads_;
+    // enqueue to dequeue time per item
+    log_histogram::snapshot     wait_us_;
+    // handler run time per call, a call handles a whole batch in batch mode
+    log_histogram::snapshot     handler_us_;
+    std::vector<worker_stats>   workers_;
+  };
+  
+  // what an active_queue stores per item. instrumented queues stamp the
+  // items with their enqueue time, the others store the bare ITEM.
+  template <typename ITEM, bool STAMPED>
+  struct active_queue_entry
+  {
+    typedef ITEM type;
+    
+    template <typename T>
+    static T && wrap(T && i) { return std::forward<T>(i); }
+    static ITEM & item(type & e) { return e; }
+    static uint64_t stamp(const type &) { return 0; }
+  };
+  
+  template <typename ITEM>
+  struct active_queue_entry<ITEM, true>
+  {
+    struct type
+    {
+      ITEM       item_;
+      uint64_t   stamp_us_;
+    };
+    
+    static uint64_t now_us()
+    {
+      using namespace std::chrono;
+      return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+    
+    template <typename T>
+    static type wrap(T && i) { return type{std::forward<T>(i), now_us()}; }
+    static ITEM & item(type & e) { return e.item_; }
+    static uint64_t stamp(const type & e) { return e.stamp_us_; }
+  };
+
+  // STORAGE holds the queued items. it must provide try_push(),
+  // try_push_bulk(), try_pop(), try_pop_bulk(), empty(), attach_worker()
+  // and detach_worker() and be constructible from a capacity hint and
+  // the number of workers.
+  // locked_queue is a std::queue behind a mutex, mpmc_ring is a bounded
+  // lock-free ring buffer and work_stealing_queue gives every worker
+  // its own deque.
+  // idle workers are parked until a push or stop() wakes them, so
+  // WAKEUP_FREQ only remains for source compatibility.
+  // HANDLER is type erased by default. any callable taking ITEM&&, ITEM&,
+  // const ITEM& or ITEM can be given instead, so the call can be inlined
+  // and the item is moved or passed by reference rather than copied. the
+  // batch mode constructors need a default constructible HANDLER.
+  // INSTRUMENTED queues time stamp every item and record the wait and
+  // handler times and the worker utilization, see stats(). when it is
+  // false none of this is compiled in.
+  template <typename ITEM,
+            unsigned long WAKEUP_FREQ=DEFAULT_TIMEOUT_MS,
+            template <typename> class STORAGE=locked_queue,
+            typename HANDLER=std::function<void(ITEM)>,
+            bool INSTRUMENTED=false>
   class active_queue final
   {
   public:
-    typedef std::function<void(ITEM)> item_handler;
+    typedef HANDLER                                  item_handler;
+    typedef std::function<void(std::vector<ITEM> &)> batch_handler;
 
   private:
-    typedef std::mutex                   mtx;
-    typedef std::queue<ITEM>             q;
-    typedef std::condition_variable      cond;
-    typedef std::vector<std::thread>     thread_vector;
-    typedef std::atomic<bool>            flag;
-    typedef std::unique_lock<mtx>        lock;
+    typedef active_queue_entry<ITEM, INSTRUMENTED>      entry_traits;
+    typedef typename entry_traits::type                 queued;
+    typedef std::integral_constant<bool, INSTRUMENTED>  instrumented;
+    typedef STORAGE<queued>                             q;
+    typedef std::atomic<bool>                           flag;
+    typedef std::atomic<uint64_t>                       counter;
+    
+    // a worker slot is reused when a retired thread is replaced
+    struct worker
+    {
+      std::thread   thread_;
+      flag          running_;
+      counter       busy_us_;
+      counter       idle_us_;
+      counter       n_handled_;
+      
+      worker() : running_{false}, busy_us_{0}, idle_us_{0}, n_handled_{0} {}
+    };
+    
+    typedef std::unique_ptr<worker>      worker_ptr;
+    typedef std::vector<worker_ptr>      worker_vector;
+    
+    struct lane
+    {
+      q          queue_;
+      counter    enqueued_;
+      counter    done_;
+      unsigned   weight_;
+      
+      lane(size_t capacity, unsigned int nthreads, unsigned weight)
+      : queue_(capacity, nthreads),
+        enqueued_{0},
+        done_{0},
+        weight_(weight) {}
+    };
+    
+    typedef std::unique_ptr<lane>        lane_ptr;
+    typedef std::vector<lane_ptr>        lane_vector;
+    
+    // items of a strand run in push order and never concurrently: a
+    // strand is either idle or scheduled, and a scheduled strand sits in
+    // ready_strands_ or is being run by exactly one worker
+    struct strand
+    {
+      std::mutex         mutex_;
+      std::deque<queued> items_;
+      bool               scheduled_;
+      
+      strand() : scheduled_(false) {}
+    };
+    
+    typedef std::unique_ptr<strand>      strand_ptr;
+    typedef std::vector<strand_ptr>      strand_vector;
+    typedef std::lock_guard<std::mutex>  lock;
+    
+    // a worker runs this many items of a strand before requeueing it,
+    // so busy keys do not starve the others
+    static const size_t strand_turn = 16;
+    
+    // per worker position in the weighted lane rotation
+    struct lane_cursor
+    {
+      size_t     lane_;
+      uint64_t   served_;
+    };
     
     active_queue() = delete;
     active_queue(const active_queue&) = delete;
     active_queue & operator=(const active_queue &) = delete;
     
-    mutable mtx     mutex_;
-    cond            cond_;
-    mutable mtx     progress_mutex_;
-    cond            progress_cond_;
-    uint64_t        enqueued_;
-    uint64_t        done_;
-    q               queue_;
-    barrier         barrier_;
-    item_handler    handler_;
-    thread_vector   threads_;
-    flag            stop_;
+    parker                 workers_parker_;
+    parker                 progress_parker_;
+    parker                 space_parker_;
+    counter                enqueued_;
+    counter                done_;
+    counter                depth_;
+    counter                high_water_mark_;
+    counter                dropped_;
+    counter                exceptions_;
+    log_histogram          wait_us_;
+    log_histogram          handler_us_;
+    active_queue_options   options_;
+    lane_vector            lanes_;
+    strand_vector          strands_;
+    locked_queue<size_t>   ready_strands_;
+    barrier                barrier_;
+    item_handler           handler_;
+    batch_handler          batch_handler_;
+    size_t                 max_batch_;
+    unsigned int           min_threads_;
+    std::atomic<unsigned>  live_;
+    flag                   started_;
+    std::mutex             threads_mutex_;
+    worker_vector          workers_;
+    flag                   stop_;
     
   public:
     static const unsigned int wakeup_freq() { return WAKEUP_FREQ; }
     
-    active_queue(unsigned int nthreads, item_handler handler)
+    // the capacity is enforced by active_queue and also passed to the
+    // storage, so mpmc_ring is sized by it
+    active_queue(unsigned int nthreads,
+                 item_handler handler,
+                 const active_queue_options & options)
     : enqueued_{0},
       done_{0},
+      depth_{0},
+      high_water_mark_{0},
+      dropped_{0},
+      exceptions_{0},
+      options_(options),
+      ready_strands_(0, 0),
       barrier_(nthreads+1),
-      handler_(handler),
+      handler_(std::move(handler)),
+      max_batch_(0),
+      min_threads_(nthreads),
+      live_{0},
+      started_{false},
       stop_(false)
     {
-      // starting all threads in the constructor
-      for( unsigned int i=0; i<nthreads; ++i )
-      {
-        threads_.push_back(std::move(std::thread(std::bind(&active_queue::entry,this))));
-      }
-      
-      // this won't return till all threads are ready
-      barrier_.wait();
-      
-      // give a chance to the workers to reach wait() before this
-      // thread start sending in the items
-      std::this_thread::yield();
+      init_lanes(n_slots());
+      init_strands(nthreads);
+      start_threads();
+    }
+    
+    active_queue(unsigned int nthreads,
+                 item_handler handler,
+                 size_t capacity=0)
+    : active_queue(nthreads, std::move(handler), active_queue_options(capacity)) {}
+    
+    // in batch mode the workers dequeue up to max_batch items at once
+    // and pass them to the handler in a single call
+    active_queue(unsigned int nthreads,
+                 batch_handler handler,
+                 size_t max_batch,
+                 const active_queue_options & options)
+    : enqueued_{0},
+      done_{0},
+      depth_{0},
+      high_water_mark_{0},
+      dropped_{0},
+      exceptions_{0},
+      options_(options),
+      ready_strands_(0, 0),
+      barrier_(nthreads+1),
+      handler_(),
+      batch_handler_(std::move(handler)),
+      max_batch_(max_batch ? max_batch : 1),
+      min_threads_(nthreads),
+      live_{0},
+      started_{false},
+      stop_(false)
+    {
+      init_lanes(n_slots());
+      init_strands(nthreads);
+      start_threads();
     }
     
+    active_queue(unsigned int nthreads,
+                 batch_handler handler,
+                 size_t max_batch,
+                 size_t capacity=0)
+    : active_queue(nthreads, std::move(handler), max_batch, active_queue_options(capacity)) {}
+    
     uint64_t n_done() const
     {
-      uint64_t ret = 0;
-      {
-        lock l(progress_mutex_);
-        ret = done_;
-      }
-      return ret;
+      return done_.load();
     }
 
     uint64_t n_enqueued() const
     {
-      uint64_t ret = 0;
+      return enqueued_.load();
+    }
+    
+    uint64_t n_done(unsigned int priority) const
+    {
+      return get_lane(priority).done_.load();
+    }
+    
+    uint64_t n_enqueued(unsigned int priority) const
+    {
+      return get_lane(priority).enqueued_.load();
+    }
+    
+    unsigned int n_lanes() const
+    {
+      return lanes_.size();
+    }
+    
+    // number of running workers
+    unsigned int n_threads() const
+    {
+      return live_.load();
+    }
+    
+    // items discarded by the drop_oldest policy. these are counted as
+    // done, so wait_empty() does not wait for them
+    uint64_t n_dropped() const
+    {
+      return dropped_.load();
+    }
+    
+    // number of items waiting to be dequeued
+    size_t size() const
+    {
+      return depth_.load();
+    }
+    
+    size_t high_water_mark() const
+    {
+      return high_water_mark_.load();
+    }
+    
+    size_t capacity() const
+    {
+      return options_.capacity_;
+    }
+    
+    // handler calls that threw
+    uint64_t n_exceptions() const
+    {
+      return exceptions_.load();
+    }
+    
+    // the counters are read one by one, so they may be slightly apart
+    // while the queue is busy
+    active_queue_stats stats() const
+    {
+      active_queue_stats ret;
+      ret.n_enqueued_       = enqueued_.load();
+      ret.n_done_           = done_.load();
+      ret.n_dropped_        = dropped_.load();
+      ret.n_exceptions_     = exceptions_.load();
+      ret.size_             = depth_.load();
+      ret.high_water_mark_  = high_water_mark_.load();
+      ret.n_threads_        = live_.load();
+      if( INSTRUMENTED )
       {
-        lock l(progress_mutex_);
-        ret = enqueued_;
+        ret.wait_us_     = wait_us_.get();
+        ret.handler_us_  = handler_us_.get();
+        for( auto & w : workers_ )
+        {
+          ret.workers_.push_back({w->busy_us_.load(),
+                                  w->idle_us_.load(),
+                                  w->n_handled_.load()});
+        }
       }
       return ret;
     }
     
-    void push(const ITEM & i)
+    // returns false if the item was not queued, because the queue is
+    // stopped or full (see queue_overflow)
+    bool push(const ITEM & i, unsigned int priority=0)
     {
-      if( stopped() ) return;
-      {
-        lock l(progress_mutex_);
-        ++enqueued_;
-      }
+      return enqueue(i, get_lane(priority));
+    }
+    
+    bool push(ITEM && i, unsigned int priority=0)
+    {
+      return enqueue(std::move(i), get_lane(priority));
+    }
+    
+    // pushes a range of items with one progress update and a single
+    // round of wakeups per admitted chunk. returns the number of items
+    // queued, which is less than the range when the queue is full.
+    template <typename IT>
+    size_t push_bulk(IT first, IT last, unsigned int priority=0)
+    {
+      lane & ln = get_lane(priority);
+      size_t ret = 0;
+      size_t n = std::distance(first, last);
+      while( n )
       {
-        lock l(mutex_);
-        queue_.push(i);
-        cond_.notify_one();
+        size_t admitted = admit(n);
+        if( !admitted ) break;
+        
+        IT chunk_end = first;
+        std::advance(chunk_end, admitted);
+        enqueued_ += admitted;
+        ln.enqueued_ += admitted;
+        size_t stored = store_bulk(ln, first, chunk_end, instrumented());
+        if( stored < admitted )
+        {
+          // stopped while waiting for a bounded storage
+          size_t left = admitted-stored;
+          enqueued_ -= left;
+          ln.enqueued_ -= left;
+          depth_ -= left;
+          return ret+stored;
+        }
+        first = chunk_end;
+        wake_workers(admitted);
+        maybe_grow();
+        ret += admitted;
+        n   -= admitted;
       }
+      return ret;
     }
     
-    void push(ITEM && i)
+    // items pushed with equal keys are handled one at a time in push
+    // order, while different keys are spread across all workers
+    template <typename KEY, typename T>
+    bool push_keyed(const KEY & key, T && i)
     {
-      if( stopped() ) return;
+      if( !admit(1) ) return false;
+      ++enqueued_;
+      
+      size_t id = std::hash<KEY>()(key) % strands_.size();
+      strand & st = *strands_[id];
+      bool schedule = false;
       {
-        lock l(progress_mutex_);
-        ++enqueued_;
+        lock l(st.mutex_);
+        st.items_.push_back(entry_traits::wrap(std::forward<T>(i)));
+        if( !st.scheduled_ )
+        {
+          st.scheduled_ = true;
+          schedule = true;
+        }
       }
+      
+      // a scheduled strand gets the new item on its current turn
+      if( schedule )
       {
-        lock l(mutex_);
-        queue_.push(std::move(i));
-        cond_.notify_one();
+        ready_strands_.try_push(id);
+        wake_workers(1);
       }
+      maybe_grow();
+      return true;
+    }
+    
+    size_t push_bulk(std::vector<ITEM> && items, unsigned int priority=0)
+    {
+      size_t ret = push_bulk(std::make_move_iterator(items.begin()),
+                             std::make_move_iterator(items.end()),
+                             priority);
+      items.clear();
+      return ret;
     }
     
     bool stopped() const
@@ -127,37 +508,32 @@ namespace virtdb { namespace utils {
     template <typename T>
     bool wait_empty(const T & progress_for)
     {
-      size_t enqueued_items = 0;
-      size_t done_items     = 0;
-      
-      {
-        lock l(progress_mutex_);
-        
-        enqueued_items = enqueued_;
-        done_items     = done_;
-      }
+      size_t enqueued_items = enqueued_;
+      size_t done_items     = done_;
         
       while( enqueued_ > done_items && !stopped() )
       {
         size_t last_done = done_items;
-        std::cv_status cvstat = std::cv_status::no_timeout;
+        bool timed_out = false;
+        auto deadline = std::chrono::steady_clock::now() + progress_for;
         
+        // give time to the threads to progress
+        while( !timed_out && done_ == last_done && !stopped() )
         {
-          lock l(progress_mutex_);
-          
-          if( enqueued_ > done_ )
+          parker::ticket t = progress_parker_.prepare_park();
+          if( done_ != last_done || stopped() )
           {
-            // give time to the threads to progress
-            cvstat = progress_cond_.wait_for(l, progress_for);
+            progress_parker_.cancel_park();
+            break;
           }
-          
-          enqueued_items = enqueued_;
-          done_items     = done_;
+          timed_out = !progress_parker_.park_until(t, deadline);
         }
         
+        enqueued_items = enqueued_;
+        done_items     = done_;
+        
         // if no progress has been made, then stop waiting for them
-        if( last_done == done_items &&
-            cvstat == std::cv_status::timeout )
+        if( last_done == done_items && timed_out )
         {
           break;
         }
@@ -169,13 +545,23 @@ namespace virtdb { namespace utils {
     void stop()
     {
       stop_ = true;
-      cond_.notify_all();
-      progress_cond_.notify_all();
-      for( auto & t : threads_ )
+      workers_parker_.unpark_all();
+      progress_parker_.unpark_all();
+      space_parker_.unpark_all();
+      
+      // joined without threads_mutex_, as a retiring worker takes it.
+      // no thread is spawned once stop_ is set.
+      std::vector<std::thread> threads;
       {
-        if( t.joinable() )
-          t.join();
+        std::lock_guard<std::mutex> l(threads_mutex_);
+        for( auto & w : workers_ )
+        {
+          if( w->thread_.joinable() )
+            threads.push_back(std::move(w->thread_));
+        }
       }
+      for( auto & t : threads )
+        t.join();
     }
     
     ~active_queue()
@@ -184,58 +570,610 @@ namespace virtdb { namespace utils {
     }
     
   private:
-    void entry()
+    void init_lanes(unsigned int nthreads)
     {
-      // synchronize between the threads and the constructor
+      unsigned int n = std::max(options_.n_lanes_, 1u);
+      for( unsigned int i=0; i<n; ++i )
+      {
+        unsigned weight = 1;
+        if( i < options_.lane_weights_.size() )
+          weight = std::max(options_.lane_weights_[i], 1u);
+        lanes_.push_back(lane_ptr{new lane(options_.capacity_, nthreads, weight)});
+      }
+    }
+    
+    void init_strands(unsigned int nthreads)
+    {
+      size_t n = options_.n_strands_;
+      if( !n ) n = 4*std::max(nthreads, 1u);
+      for( size_t i=0; i<n; ++i )
+        strands_.push_back(strand_ptr{new strand});
+    }
+    
+    lane & get_lane(unsigned int priority) const
+    {
+      if( priority >= lanes_.size() )
+      {
+        THROW_("priority out of bounds");
+      }
+      return *lanes_[priority];
+    }
+    
+    unsigned int n_slots() const
+    {
+      return std::max(min_threads_, options_.max_threads_);
+    }
+    
+    bool elastic() const
+    {
+      return options_.max_threads_ > min_threads_;
+    }
+    
+    void start_threads()
+    {
+      for( unsigned int i=0; i<n_slots(); ++i )
+        workers_.push_back(worker_ptr{new worker});
+      
+      if( options_.lazy_start_ )
+        return;
+      
+      // starting all threads in the constructor
+      {
+        std::lock_guard<std::mutex> l(threads_mutex_);
+        for( unsigned int i=0; i<min_threads_; ++i )
+          spawn(i, true);
+        started_ = true;
+      }
+      
+      // this won't return till all threads are ready
       barrier_.wait();
       
-      // check if we can still run
+      // give a chance to the workers to reach wait() before this
+      // thread start sending in the items
+      std::this_thread::yield();
+    }
+    
+    // must be called with threads_mutex_ held
+    void spawn(unsigned int slot, bool sync)
+    {
+      worker & w = *workers_[slot];
+      // the slot may belong to a retired thread that is about to exit
+      if( w.thread_.joinable() )
+        w.thread_.join();
+      w.running_ = true;
+      ++live_;
+      w.thread_ = std::thread(std::bind(&active_queue::entry,this,slot,sync));
+    }
+    
+    // called after every push: starts the lazy workers and grows an
+    // elastic pool when the queue builds up
+    void maybe_grow()
+    {
+      if( !started_.load() )
+      {
+        std::lock_guard<std::mutex> l(threads_mutex_);
+        if( started_ || stopped() ) return;
+        for( unsigned int i=0; i<min_threads_; ++i )
+          spawn(i, false);
+        started_ = true;
+      }
+      
+      if( !elastic() ) return;
+      
+      // a retiring worker checks depth_ after leaving live_, so either
+      // it stays or we see it gone
+      unsigned int live = live_.load();
+      if( live >= options_.max_threads_ ) return;
+      if( live > 0 && depth_.load() <= live*options_.grow_depth_ )
+        return;
+      
+      // with no live worker the item would sit unprocessed, so wait for a
+      // concurrent retire() instead of skipping the growth
+      std::unique_lock<std::mutex> l(threads_mutex_, std::defer_lock);
+      if( live == 0 )
+        l.lock();
+      else if( !l.try_lock() )
+        return;
+      if( stopped() ) return;
+      for( unsigned int i=0; i<workers_.size(); ++i )
+      {
+        if( !workers_[i]->running_ )
+        {
+          spawn(i, false);
+          return;
+        }
+      }
+    }
+    
+    // leaves the pool if we are above min_threads_ and there is no work.
+    // the slot is freed under threads_mutex_ before the final check, so a
+    // producer queueing after it can already respawn the slot
+    bool retire(worker & w)
+    {
+      std::lock_guard<std::mutex> l(threads_mutex_);
+      // stop() joins us anyway
+      if( stopped() ) return false;
+      unsigned int live = live_.load();
+      while( live > min_threads_ )
+      {
+        if( live_.compare_exchange_weak(live, live-1) )
+        {
+          w.running_ = false;
+          // a producer may have counted on us after queueing its item
+          if( depth_.load() == 0 )
+            return true;
+          w.running_ = true;
+          ++live_;
+          return false;
+        }
+      }
+      return false;
+    }
+    
+    template <typename T>
+    bool enqueue(T && i, lane & ln)
+    {
+      if( !admit(1) ) return false;
+      ++enqueued_;
+      ++ln.enqueued_;
+      auto && e = entry_traits::wrap(std::forward<T>(i));
+      while( !ln.queue_.try_push(std::forward<decltype(e)>(e)) )
+      {
+        // a bounded storage is full, wait for the workers to catch up
+        if( stopped() )
+        {
+          --enqueued_;
+          --ln.enqueued_;
+          --depth_;
+          return false;
+        }
+        std::this_thread::yield();
+      }
+      wake_workers(1);
+      maybe_grow();
+      return true;
+    }
+    
+    // pushes [first,last) to the storage, returns the number of items
+    // stored, which is less than the range only when stopped
+    template <typename IT>
+    size_t store_bulk(lane & ln, IT first, IT last, std::false_type)
+    {
+      IT it = first;
+      while( (it = ln.queue_.try_push_bulk(it, last)) != last )
+      {
+        if( stopped() ) break;
+        std::this_thread::yield();
+      }
+      return std::distance(first, it);
+    }
+    
+    template <typename IT>
+    size_t store_bulk(lane & ln, IT first, IT last, std::true_type)
+    {
+      std::vector<queued> entries;
+      entries.reserve(std::distance(first, last));
+      for( ; first != last; ++first )
+        entries.push_back(entry_traits::wrap(*first));
+      return store_bulk(ln,
+                        std::make_move_iterator(entries.begin()),
+                        std::make_move_iterator(entries.end()),
+                        std::false_type());
+    }
+    
+    // reserves room for up to n items, returns how many fit in
+    size_t reserve(size_t n)
+    {
+      uint64_t depth = 0;
+      if( !options_.capacity_ )
+      {
+        depth = depth_.fetch_add(n)+n;
+      }
+      else
+      {
+        depth = depth_.load();
+        while( true )
+        {
+          if( depth >= options_.capacity_ ) return 0;
+          n = std::min<uint64_t>(n, options_.capacity_-depth);
+          if( depth_.compare_exchange_weak(depth, depth+n) ) break;
+        }
+        depth += n;
+      }
+      
+      uint64_t hwm = high_water_mark_.load(std::memory_order_relaxed);
+      while( depth > hwm &&
+             !high_water_mark_.compare_exchange_weak(hwm, depth,
+                                                     std::memory_order_relaxed) ) {}
+      return n;
+    }
+    
+    // applies the overflow policy until at least one item fits in
+    size_t admit(size_t n)
+    {
+      bool has_deadline = false;
+      parker::time_point_t deadline;
+      
       while( !stopped() )
       {
-        ITEM tmp;
-        bool has_item = false;
+        size_t ret = reserve(n);
+        if( ret ) return ret;
+        
+        switch( options_.overflow_ )
         {
-          lock l(mutex_);
-          
-          if( queue_.empty() )
+          case queue_overflow::reject:
+            return 0;
+            
+          case queue_overflow::drop_oldest:
           {
-            cond_.wait_for(l,std::chrono::milliseconds(WAKEUP_FREQ));
+            // the lowest priority items go first. keyed items are never
+            // dropped, so wait for the workers when only those are queued
+            queued oldest{};
+            bool dropped = false;
+            for( auto & ln : lanes_ )
+            {
+              if( ln->queue_.try_pop(oldest) )
+              {
+                released(1);
+                ++dropped_;
+                ++ln->done_;
+                ++done_;
+                progress_parker_.unpark_all();
+                dropped = true;
+                break;
+              }
+            }
+            if( !dropped ) std::this_thread::yield();
+            break;
           }
-          
-          if( !queue_.empty() )
+            
+          case queue_overflow::block:
           {
-            // we first dequeue the element, so we don't need to hold
-            // the lock while the thread handler runs
-            has_item = true;
-            tmp = std::move(queue_.front());
-            queue_.pop();
-          }          
+            if( !has_deadline )
+            {
+              deadline = (std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(options_.block_timeout_ms_));
+              has_deadline = true;
+            }
+            parker::ticket t = space_parker_.prepare_park();
+            if( depth_ < options_.capacity_ || stopped() )
+              space_parker_.cancel_park();
+            else if( !space_parker_.park_until(t, deadline) )
+              return 0;
+            break;
+          }
         }
-        
-        // the thread now processes the item outside the lock
-        if( has_item )
+      }
+      return 0;
+    }
+    
+    void released(size_t n)
+    {
+      depth_ -= n;
+      if( options_.capacity_ )
+        space_parker_.unpark_all();
+    }
+    
+    // this is only an atomic load unless a worker is parked
+    void wake_workers(size_t n)
+    {
+      if( n > 1 ) workers_parker_.unpark_all();
+      else        workers_parker_.unpark_one();
+    }
+    
+    size_t dequeue(lane & ln, queued & tmp, std::vector<queued> & batch)
+    {
+      size_t ret = 0;
+      if( max_batch_ )
+        ret = ln.queue_.try_pop_bulk(batch, max_batch_);
+      else
+        ret = ln.queue_.try_pop(tmp) ? 1 : 0;
+      if( ret ) released(ret);
+      return ret;
+    }
+    
+    // picks the lane to serve and sets from to the lane of the result
+    size_t dequeue(lane_cursor & cursor,
+                   queued & tmp,
+                   std::vector<queued> & batch,
+                   lane *& from)
+    {
+      size_t n_lanes = lanes_.size();
+      size_t ret = 0;
+      
+      if( options_.lane_weights_.empty() || n_lanes == 1 )
+      {
+        // strict priority order, the highest lane first
+        for( size_t i=n_lanes; i-- > 0 && !ret; )
         {
-          try
+          from = lanes_[i].get();
+          ret = dequeue(*from, tmp, batch);
+        }
+        return ret;
+      }
+      
+      // weighted round robin: stay on a lane till its weight is used up
+      // or it runs empty, then move on to the next one
+      for( size_t tries=0; tries<=n_lanes && !ret; ++tries )
+      {
+        from = lanes_[cursor.lane_].get();
+        if( cursor.served_ < from->weight_ &&
+            (ret = dequeue(*from, tmp, batch)) )
+        {
+          cursor.served_ += ret;
+        }
+        else
+        {
+          cursor.lane_   = (cursor.lane_+1) % n_lanes;
+          cursor.served_ = 0;
+        }
+      }
+      return ret;
+    }
+    
+    // handlers that accept an rvalue get the item moved in, the others
+    // (taking ITEM&) get a reference to it
+    template <typename H>
+    static auto call(H & h, ITEM & i, int) -> decltype(h(std::move(i)), void())
+    {
+      h(std::move(i));
+    }
+    
+    template <typename H>
+    static void call(H & h, ITEM & i, long)
+    {
+      h(i);
+    }
+    
+    // the batch handler takes the bare items, so instrumented queues
+    // move them out of the entries first
+    std::vector<ITEM> & items_of(std::vector<queued> & batch,
+                                 std::vector<ITEM> &,
+                                 std::false_type)
+    {
+      return batch;
+    }
+    
+    std::vector<ITEM> & items_of(std::vector<queued> & batch,
+                                 std::vector<ITEM> & items,
+                                 std::true_type)
+    {
+      items.clear();
+      for( auto & e : batch )
+        items.push_back(std::move(e.item_));
+      return items;
+    }
+    
+    static uint64_t now_us()
+    {
+      return active_queue_entry<ITEM, true>::now_us();
+    }
+    
+    void handle(queued & tmp,
+                std::vector<queued> & batch,
+                std::vector<ITEM> & items,
+                worker & w)
+    {
+      uint64_t started = 0;
+      if( INSTRUMENTED )
+      {
+        started = now_us();
+        if( max_batch_ )
+        {
+          for( auto & e : batch )
+            wait_us_.record(started - std::min(started, entry_traits::stamp(e)));
+        }
+        else
+        {
+          wait_us_.record(started - std::min(started, entry_traits::stamp(tmp)));
+        }
+      }
+      
+      try
+      {
+        if( max_batch_ )
+          batch_handler_(items_of(batch, items, instrumented()));
+        else
+          call(handler_, entry_traits::item(tmp), 0);
+      }
+      catch( const std::exception & e )
+      {
+        ++exceptions_;
+        std::cerr << "exception caught: " << e.what() << "\n";
+      }
+      catch(...)
+      {
+        ++exceptions_;
+        std::cerr << "unknown exception caught\n";
+      }
+      
+      if( INSTRUMENTED )
+      {
+        uint64_t took = now_us() - started;
+        handler_us_.record(took);
+        w.busy_us_.fetch_add(took, std::memory_order_relaxed);
+        w.n_handled_.fetch_add(max_batch_ ? batch.size() : 1,
+                               std::memory_order_relaxed);
+      }
+    }
+    
+    // runs one turn of a ready strand, returns the number of items handled
+    size_t run_strand(queued & tmp,
+                      std::vector<queued> & batch,
+                      std::vector<ITEM> & items,
+                      worker & w)
+    {
+      size_t id = 0;
+      if( !ready_strands_.try_pop(id) ) return 0;
+      strand & st = *strands_[id];
+      size_t ret = 0;
+      
+      while( ret < strand_turn )
+      {
+        size_t n_items = 0;
+        {
+          lock l(st.mutex_);
+          if( max_batch_ )
           {
-            handler_(tmp);
+            while( n_items < max_batch_ && !st.items_.empty() )
+            {
+              batch.push_back(std::move(st.items_.front()));
+              st.items_.pop_front();
+              ++n_items;
+            }
           }
-          catch( const std::exception & e )
+          else if( !st.items_.empty() )
           {
-            std::cerr << "exception caught: " << e.what() << "\n";
+            tmp = std::move(st.items_.front());
+            st.items_.pop_front();
+            n_items = 1;
           }
-          catch(...)
+        }
+        if( !n_items ) break;
+        
+        released(n_items);
+        handle(tmp, batch, items, w);
+        batch.clear();
+        done_ += n_items;
+        progress_parker_.unpark_all();
+        ret += n_items;
+      }
+      
+      // give the strand up or put it back at the end of the line
+      bool requeue = false;
+      {
+        lock l(st.mutex_);
+        if( st.items_.empty() )
+          st.scheduled_ = false;
+        else
+          requeue = true;
+      }
+      if( requeue )
+      {
+        ready_strands_.try_push(id);
+        wake_workers(1);
+      }
+      return ret;
+    }
+    
+    void entry(unsigned int index, bool sync)
+    {
+      for( auto & ln : lanes_ )
+        ln->queue_.attach_worker(index);
+      
+      // synchronize between the threads and the constructor
+      if( sync )
+        barrier_.wait();
+      
+      worker & w = *workers_[index];
+      std::vector<queued> batch;
+      std::vector<ITEM> items;
+      batch.reserve(max_batch_);
+      if( INSTRUMENTED ) items.reserve(max_batch_);
+      lane_cursor cursor{lanes_.size()-1, 0};
+      lane * from = nullptr;
+      bool strand_first = false;
+      bool retired = false;
+      
+      // check if we can still run
+      while( !stopped() )
+      {
+        queued tmp{};
+        batch.clear();
+        
+        // alternate between strands and lanes, so neither starves
+        strand_first = !strand_first;
+        if( strand_first && run_strand(tmp, batch, items, w) )
+          continue;
+        
+        // we first dequeue the element, so we don't need to hold
+        // any lock while the thread handler runs
+        size_t n_items = dequeue(cursor, tmp, batch, from);
+        if( !n_items && !strand_first && run_strand(tmp, batch, items, w) )
+          continue;
+        
+        if( !n_items )
+        {
+          parker::ticket t = workers_parker_.prepare_park();
+          
+          // recheck after announcing ourself, so a concurrent push
+          // either sees us parking or we see its item
+          n_items = dequeue(cursor, tmp, batch, from);
+          if( n_items || !ready_strands_.empty() || stopped() )
           {
-            std::cerr << "unknown exception caught\n";
+            workers_parker_.cancel_park();
           }
-          // signal wait_empty, no matter what the result was
+          else
           {
-            lock l(progress_mutex_);
-            ++done_;
-            progress_cond_.notify_one();
+            uint64_t parked_at = INSTRUMENTED ? now_us() : 0;
+            bool timed_out = false;
+            if( !elastic() )
+            {
+              workers_parker_.park(t);
+            }
+            else
+            {
+              auto idle_till = (std::chrono::steady_clock::now() +
+                                std::chrono::milliseconds(options_.idle_ms_));
+              timed_out = !workers_parker_.park_until(t, idle_till);
+            }
+            if( INSTRUMENTED )
+              w.idle_us_.fetch_add(now_us()-parked_at, std::memory_order_relaxed);
+            if( timed_out && retire(w) )
+            {
+              retired = true;
+              break;
+            }
           }
         }
+        
+        // the thread now processes the item outside the lock
+        if( n_items )
+        {
+          handle(tmp, batch, items, w);
+          // signal wait_empty, no matter what the result was
+          from->done_ += n_items;
+          done_ += n_items;
+          progress_parker_.unpark_all();
+        }
+      }
+      
+      for( auto & ln : lanes_ )
+        ln->queue_.detach_worker();
+      if( !retired )
+      {
+        --live_;
+        w.running_ = false;
       }
     }
   };
+  
+  // active_queue calling HANDLER directly instead of through std::function
+  template <typename ITEM,
+            typename HANDLER,
+            template <typename> class STORAGE=locked_queue>
+  using inline_active_queue = active_queue<ITEM, DEFAULT_TIMEOUT_MS, STORAGE, HANDLER>;
+  
+  // active_queue collecting latency and utilization stats
+  template <typename ITEM,
+            template <typename> class STORAGE=locked_queue>
+  using instrumented_active_queue = active_queue<ITEM,
+                                                 DEFAULT_TIMEOUT_MS,
+                                                 STORAGE,
+                                                 std::function<void(ITEM)>,
+                                                 true>;
+  
+  // deduces the handler type, e.g. for lambdas
+  template <typename ITEM,
+            template <typename> class STORAGE=locked_queue,
+            typename HANDLER>
+  std::unique_ptr<inline_active_queue<ITEM, HANDLER, STORAGE>>
+  make_active_queue(unsigned int nthreads,
+                    HANDLER handler,
+                    const active_queue_options & options=active_queue_options())
+  {
+    typedef inline_active_queue<ITEM, HANDLER, STORAGE> queue_t;
+    return std::unique_ptr<queue_t>{new queue_t(nthreads, std::move(handler), options)};
+  }
 
 }}
@@ -1,5 +1,4 @@
 #include <utils/barrier.hh>
-#include <utils/constants.hh>
 #include <cassert>
 #include <chrono>
 
@@ -18,64 +17,72 @@ barrier::~barrier()
   {
     // we let everyone go because after this object was destroyed
     // noone will be able to continue
-    lock l(mutex_);
     nwaiting_ = nthreads_;
-    cond_.notify_all();
+    parker_.unpark_all();
   }
 }
 
 void
 barrier::wait()
 {
+  // register ourself as waiting, the last one releases the others
+  if( ++nwaiting_ >= nthreads_ )
   {
-    // register ourself as waiting
-    lock l(mutex_);
-    ++nwaiting_;
-    cond_.notify_all();
+    parker_.unpark_all();
+    return;
   }
   
   while( true )
   {
-    lock l(mutex_);
+    parker::ticket t = parker_.prepare_park();
     
     // enough threads are waiting, barrier is done
     if( nwaiting_ >= nthreads_ )
+    {
+      parker_.cancel_park();
       return;
+    }
     
-    // doing this in a timed loop, so we don't rely on notifications alone
-    cond_.wait_for(l, std::chrono::milliseconds(SHORT_TIMEOUT_MS) );
+    parker_.park(t);
   }
 }
 
 bool
 barrier::wait_for(unsigned int timeout_ms)
 {
+  // register ourself as waiting, the last one releases the others
+  if( ++nwaiting_ >= nthreads_ )
   {
-    // register ourself as waiting
-    lock l(mutex_);
-    ++nwaiting_;
-    cond_.notify_all();
+    parker_.unpark_all();
+    return true;
   }
   
   using namespace std::chrono;
-  typedef std::chrono::steady_clock::time_point time_point_t;
-  time_point_t now = steady_clock::now();
-  time_point_t max_wait = now + milliseconds{timeout_ms};
+  parker::time_point_t max_wait = steady_clock::now() + milliseconds{timeout_ms};
   
   while( true )
   {
-    lock l(mutex_);
+    parker::ticket t = parker_.prepare_park();
     
     // enough threads are waiting, barrier is done
-    // it is late to check timeout condition here, because other threads
-    // had already been released
     if( nwaiting_ >= nthreads_ )
+    {
+      parker_.cancel_park();
       return true;
+    }
     
-    if( cond_.wait_until(l, max_wait) == std::cv_status::timeout )
+    if( !parker_.park_until(t, max_wait) )
     {
-      --nwaiting_;
-      return false;
+      // unregister, unless the last thread arrived in the meantime.
+      // it is late to check timeout condition after that, because
+      // other threads had already been released
+      unsigned int n = nwaiting_;
+      while( n < nthreads_ )
+      {
+        if( nwaiting_.compare_exchange_weak(n, n-1) )
+          return false;
+      }
+      return true;
     }
   }
 }
@@ -84,14 +91,11 @@ barrier::wait_for(unsigned int timeout_ms)
 bool
 barrier::ready()
 {
-  lock l(mutex_);
   return (nwaiting_ >= nthreads_);
 }
 
 void
 barrier::reset()
 {
-  lock l(mutex_);
   nwaiting_ = 0;
 }
-
@@ -1,20 +1,15 @@
 #pragma once
 
-#include <mutex>
-#include <condition_variable>
+#include <utils/parker.hh>
+#include <atomic>
 
 namespace virtdb { namespace utils {
 
   class barrier final
   {
-    typedef std::mutex               mtx;
-    typedef std::condition_variable  cond;
-    typedef std::unique_lock<mtx>    lock;
-    
-    mtx            mutex_;
-    cond           cond_;
-    unsigned int   nwaiting_;
-    unsigned int   nthreads_;
+    parker                     parker_;
+    std::atomic<unsigned int>  nwaiting_;
+    unsigned int               nthreads_;
     
     barrier() = delete;
     barrier(const barrier &) = delete;
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <utility>
+
+namespace virtdb { namespace utils {
+
+  // block_window maps dense, mostly increasing ids to values. ids in
+  // [base_, base_+ring_.size()) sit in a ring indexed by the low bits of
+  // the id, so lookups are a mask and a compare. the ring doubles when
+  // ids run ahead, up to max_window ids, and the base moves up when the
+  // lowest values are erased. ids below the base or beyond the window are
+  // kept in a map, and move over to the ring once the window covers them,
+  // so an id is never in both. with max_window=0 everything goes to the
+  // map.
+  // block_window is not thread safe.
+  template <typename V>
+  class block_window final
+  {
+    typedef std::unique_ptr<V>           value_ptr;
+    typedef std::vector<value_ptr>       ring;
+    typedef std::map<size_t, value_ptr>  sparse_map;
+    
+    static const size_t initial_ring_size = 16;
+    
+    ring         ring_;
+    size_t       base_;
+    size_t       n_ring_;
+    size_t       max_window_;
+    sparse_map   sparse_;
+    
+    block_window(const block_window &) = delete;
+    block_window & operator=(const block_window &) = delete;
+    
+  public:
+    explicit block_window(size_t max_window)
+    : base_(0),
+      n_ring_(0),
+      max_window_(max_window)
+    {
+    }
+    
+    V * find(size_t id)
+    {
+      if( in_ring(id) )
+        return ring_[slot(id)].get();
+      if( sparse_.empty() )
+        return nullptr;
+      auto it = sparse_.find(id);
+      return it == sparse_.end() ? nullptr : it->second.get();
+    }
+    
+    const V * find(size_t id) const
+    {
+      return const_cast<block_window *>(this)->find(id);
+    }
+    
+    // returns the value with the given id and whether it was created
+    template <typename ... ARGS>
+    std::pair<V *, bool> emplace(size_t id, ARGS && ... args)
+    {
+      V * v = find(id);
+      if( v ) return std::make_pair(v, false);
+      
+      value_ptr p{new V(std::forward<ARGS>(args)...)};
+      v = p.get();
+      if( fits_ring(id) )
+      {
+        ring_[slot(id)] = std::move(p);
+        ++n_ring_;
+        // the ring may have grown or restarted under map values
+        settle();
+      }
+      else
+      {
+        sparse_[id] = std::move(p);
+      }
+      return std::make_pair(v, true);
+    }
+    
+    bool erase(size_t id)
+    {
+      if( in_ring(id) )
+      {
+        value_ptr & p = ring_[slot(id)];
+        if( !p ) return false;
+        p.reset();
+        --n_ring_;
+        settle();
+        return true;
+      }
+      return sparse_.erase(id) > 0;
+    }
+    
+    size_t size() const
+    {
+      return n_ring_ + sparse_.size();
+    }
+    
+    bool empty() const
+    {
+      return size() == 0;
+    }
+    
+    // the smallest stored id, returns false when empty
+    bool lowest(size_t & id) const
+    {
+      if( !sparse_.empty() && (!n_ring_ || sparse_.begin()->first < base_) )
+      {
+        id = sparse_.begin()->first;
+        return true;
+      }
+      // erase() keeps the base on a stored value
+      if( n_ring_ )
+      {
+        id = base_;
+        return true;
+      }
+      return false;
+    }
+    
+    // calls f(id, value) in ascending id order. f must not add or
+    // remove values.
+    template <typename F>
+    void for_each(F f)
+    {
+      auto it = sparse_.begin();
+      for( ; it != sparse_.end() && it->first < base_; ++it )
+        f(it->first, *it->second);
+        
+      for( size_t i=0; n_ring_ && i<ring_.size(); ++i )
+      {
+        size_t id = base_+i;
+        value_ptr & p = ring_[slot(id)];
+        if( p ) f(id, *p);
+      }
+      
+      for( ; it != sparse_.end(); ++it )
+        f(it->first, *it->second);
+    }
+    
+    void clear()
+    {
+      for( auto & p : ring_ )
+        p.reset();
+      n_ring_ = 0;
+      sparse_.clear();
+    }
+    
+  private:
+    size_t slot(size_t id) const
+    {
+      return id & (ring_.size()-1);
+    }
+    
+    bool in_ring(size_t id) const
+    {
+      return id >= base_ && id-base_ < ring_.size();
+    }
+    
+    // slides the window past the erased values and moves the map values
+    // it now covers into the ring, so find() needs to look at one place
+    void settle()
+    {
+      while( true )
+      {
+        if( !sparse_.empty() && !ring_.empty() )
+        {
+          auto it = sparse_.lower_bound(base_);
+          while( it != sparse_.end() && in_ring(it->first) )
+          {
+            ring_[slot(it->first)] = std::move(it->second);
+            ++n_ring_;
+            it = sparse_.erase(it);
+          }
+        }
+        if( !n_ring_ || ring_[slot(base_)] )
+          return;
+        while( !ring_[slot(base_)] )
+          ++base_;
+      }
+    }
+    
+    // makes room for id in the ring if that is possible
+    bool fits_ring(size_t id)
+    {
+      if( !max_window_ ) return false;
+      
+      // an empty ring restarts at the new id
+      if( !n_ring_ )
+        base_ = id;
+        
+      if( in_ring(id) ) return true;
+      if( id < base_ || id-base_ >= max_window_ ) return false;
+      
+      size_t n = ring_.empty() ? initial_ring_size : ring_.size();
+      while( n <= id-base_ ) n *= 2;
+      
+      ring bigger(n);
+      for( size_t i=0; i<ring_.size(); ++i )
+      {
+        size_t old_id = base_+i;
+        bigger[old_id & (n-1)] = std::move(ring_[slot(old_id)]);
+      }
+      ring_.swap(bigger);
+      return true;
+    }
+  };
+  
+}}
@@ -5,5 +5,7 @@ namespace virtdb { namespace utils {
   static const unsigned long TINY_TIMEOUT_MS         = 20;
   static const unsigned long SHORT_TIMEOUT_MS        = 100;
   static const unsigned long MAX_SUBSCRIPTION_SIZE   = 1024;
+  static const unsigned long CACHE_LINE_SIZE         = 64;
+  static const unsigned long DEFAULT_RING_CAPACITY   = 4096;
+  static const unsigned long DEFAULT_BLOCK_WINDOW    = 65536;
 }}
-
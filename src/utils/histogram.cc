@@ -0,0 +1,98 @@
+#include <utils/histogram.hh>
+#include <limits>
+#include <algorithm>
+
+using namespace virtdb::utils;
+
+log_histogram::snapshot::snapshot()
+: buckets_(),
+  count_(0),
+  sum_(0),
+  max_(0)
+{
+}
+
+double
+log_histogram::snapshot::mean() const
+{
+  if( !count_ ) return 0.0;
+  return static_cast<double>(sum_)/count_;
+}
+
+uint64_t
+log_histogram::snapshot::percentile(double fraction) const
+{
+  if( !count_ ) return 0;
+  if( fraction < 0.0 ) fraction = 0.0;
+  if( fraction > 1.0 ) fraction = 1.0;
+  
+  uint64_t target = static_cast<uint64_t>(fraction*count_);
+  if( target == 0 ) target = 1;
+  
+  uint64_t seen = 0;
+  for( size_t i=0; i<n_buckets; ++i )
+  {
+    seen += buckets_[i];
+    // the max is a tighter bound for the last bucket
+    if( seen >= target )
+      return std::min(upper_bound(i), max_);
+  }
+  return max_;
+}
+
+log_histogram::log_histogram()
+: sum_{0},
+  max_{0}
+{
+  for( auto & b : buckets_ )
+    b = 0;
+}
+
+void
+log_histogram::record(uint64_t value)
+{
+  buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  
+  uint64_t mx = max_.load(std::memory_order_relaxed);
+  while( value > mx &&
+         !max_.compare_exchange_weak(mx, value, std::memory_order_relaxed) ) {}
+}
+
+log_histogram::snapshot
+log_histogram::get() const
+{
+  snapshot ret;
+  for( size_t i=0; i<n_buckets; ++i )
+  {
+    ret.buckets_[i] = buckets_[i].load(std::memory_order_relaxed);
+    ret.count_ += ret.buckets_[i];
+  }
+  ret.sum_ = sum_.load(std::memory_order_relaxed);
+  ret.max_ = max_.load(std::memory_order_relaxed);
+  return ret;
+}
+
+void
+log_histogram::reset()
+{
+  for( auto & b : buckets_ )
+    b.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+size_t
+log_histogram::bucket_of(uint64_t value)
+{
+  if( !value ) return 0;
+  return 64 - __builtin_clzll(value);
+}
+
+uint64_t
+log_histogram::upper_bound(size_t bucket)
+{
+  if( bucket == 0 ) return 0;
+  if( bucket >= 64 ) return std::numeric_limits<uint64_t>::max();
+  return (uint64_t{1} << bucket) - 1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace virtdb { namespace utils {
+
+  // lock free histogram with power of two buckets. bucket 0 counts the
+  // zero values and bucket i the values in [2^(i-1), 2^i), so recording
+  // is a few relaxed atomic adds and the relative error stays below 2x.
+  class log_histogram final
+  {
+  public:
+    static const size_t n_buckets = 65;
+    
+    struct snapshot
+    {
+      std::array<uint64_t, n_buckets>  buckets_;
+      uint64_t                         count_;
+      uint64_t                         sum_;
+      uint64_t                         max_;
+      
+      snapshot();
+      
+      double mean() const;
+      // upper bound of the bucket where the given fraction (0..1) of the
+      // values is reached, e.g. percentile(0.99)
+      uint64_t percentile(double fraction) const;
+    };
+    
+  private:
+    std::array<std::atomic<uint64_t>, n_buckets>  buckets_;
+    std::atomic<uint64_t>                         sum_;
+    std::atomic<uint64_t>                         max_;
+    
+    log_histogram(const log_histogram &) = delete;
+    log_histogram & operator=(const log_histogram &) = delete;
+    
+  public:
+    log_histogram();
+    
+    void record(uint64_t value);
+    snapshot get() const;
+    void reset();
+    
+    static size_t bucket_of(uint64_t value);
+    static uint64_t upper_bound(size_t bucket);
+  };
+  
+}}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <queue>
+#include <vector>
+#include <mutex>
+
+namespace virtdb { namespace utils {
+
+  // the default storage of active_queue: an unbounded std::queue
+  // protected by a single mutex
+  template <typename ITEM>
+  class locked_queue final
+  {
+    typedef std::mutex             mtx;
+    typedef std::lock_guard<mtx>   lock;
+    
+    mutable mtx        mutex_;
+    std::queue<ITEM>   queue_;
+    
+    locked_queue() = delete;
+    locked_queue(const locked_queue &) = delete;
+    locked_queue & operator=(const locked_queue &) = delete;
+    
+  public:
+    // the capacity hint is ignored, this queue grows as needed
+    locked_queue(size_t, size_t) {}
+    
+    // all workers share the same queue
+    void attach_worker(size_t) {}
+    void detach_worker() {}
+    
+    template <typename T>
+    bool try_push(T && i)
+    {
+      lock l(mutex_);
+      queue_.push(std::forward<T>(i));
+      return true;
+    }
+    
+    // returns the position of the first item that was not pushed
+    template <typename IT>
+    IT try_push_bulk(IT first, IT last)
+    {
+      lock l(mutex_);
+      for( ; first != last; ++first )
+        queue_.push(*first);
+      return first;
+    }
+    
+    bool try_pop(ITEM & i)
+    {
+      lock l(mutex_);
+      if( queue_.empty() )
+        return false;
+      i = std::move(queue_.front());
+      queue_.pop();
+      return true;
+    }
+    
+    // appends at most max_items to out under a single lock
+    size_t try_pop_bulk(std::vector<ITEM> & out, size_t max_items)
+    {
+      lock l(mutex_);
+      size_t ret = 0;
+      while( ret < max_items && !queue_.empty() )
+      {
+        out.push_back(std::move(queue_.front()));
+        queue_.pop();
+        ++ret;
+      }
+      return ret;
+    }
+    
+    bool empty() const
+    {
+      lock l(mutex_);
+      return queue_.empty();
+    }
+  };
+
+}}
@@ -3,6 +3,7 @@
 #include <memory>
 #include <cassert>
 #include <functional>
+#include <algorithm>
 
 namespace virtdb { namespace utils {
 
@@ -40,17 +41,19 @@ namespace virtdb { namespace utils {
     size_t    allocated_items_;
     size_t    free_items_;
     size_t    next_size_;
+    // the size of the next chunk, it doubles up to max_items_ after each
+    // new chunk. with max_items_ <= next_size_ the chunks stay next_size_.
+    size_t    chunk_items_;
+    size_t    max_items_;
+    size_t    n_chunks_;
     item *    pool_;
     mempool * next_;
+    // the chunk allocated from, kept up to date by allocate()
     mempool * last_;
     
     mempool * last()
     {
-      mempool * ret = last_;
-      mempool * p = ret->next_;
-      while( p != nullptr ) { ret = p; p = ret->next_; }
-      last_ = ret;
-      return ret;
+      return last_;
     }
     
     item * next_item()
@@ -71,10 +74,16 @@ namespace virtdb { namespace utils {
   public:
     typedef std::shared_ptr<mempool> sptr;
     
-    mempool(size_t byte_size, size_t next_size=0)
+    // with max_size above next_size the chunks grow geometrically from
+    // next_size to max_size, so a pool growing from KBs to GBs needs a
+    // logarithmic number of chunks
+    mempool(size_t byte_size, size_t next_size=0, size_t max_size=0)
     : allocated_items_(aligned_size(byte_size)),
       free_items_(allocated_items_),
       next_size_(next_size?aligned_size(next_size):allocated_items_),
+      chunk_items_(next_size_),
+      max_items_(std::max(next_size_, aligned_size(max_size))),
+      n_chunks_(1),
       pool_(allocate_items(allocated_items_)),
       next_(nullptr),
       last_(this) {}
@@ -82,23 +91,34 @@ namespace virtdb { namespace utils {
     virtual ~mempool()
     {
       clear();
+      if( pool_ )
+      {
+        delete_items(pool_);
+        pool_ = nullptr;
+      }
     }
     
+    // releases every chunk but the first one and empties that, so the
+    // pool can be allocated from again
     void clear()
     {
-      if( next_ )
+      // unlinks the chunks one by one, so long chains do not recurse
+      mempool * p = next_;
+      next_ = nullptr;
+      while( p )
       {
-        delete_pool(next_);
-        next_ = nullptr;
-      }
-      if( pool_ )
-      {
-        delete_items(pool_);
-        pool_ = nullptr;
+        mempool * n = p->next_;
+        p->next_ = nullptr;
+        delete_pool(p);
+        p = n;
       }
+      last_ = this;
+      n_chunks_ = 1;
+      free_items_ = allocated_items_;
+      chunk_items_ = next_size_;
     }
     
-    const size_t allocated_bytes() const
+    size_t allocated_bytes() const
     {
       size_t ret = allocated_items_*item_size_;
       mempool * p = next_;
@@ -110,11 +130,16 @@ namespace virtdb { namespace utils {
       return ret;
     }
     
-    const size_t next_size() const
+    size_t next_size() const
     {
       return next_size_;
     }
     
+    size_t n_chunks() const
+    {
+      return n_chunks_;
+    }
+    
     static constexpr size_t item_size() { return item_size_; }
     
     template <typename T>
@@ -150,13 +175,17 @@ namespace virtdb { namespace utils {
       if( count > p->free_items_ )
       {
         // needs a bigger pool
-        size_t to_be_allocated = next_size_;
+        size_t to_be_allocated = chunk_items_;
         while( count > to_be_allocated )
         {
           to_be_allocated += next_size_;
         }
         p->next_ = allocate_pool(to_be_allocated*item_size_,next_size_);
         p = p->next_;
+        last_ = p;
+        ++n_chunks_;
+        if( chunk_items_ < max_items_ )
+          chunk_items_ = std::min(chunk_items_*2, max_items_);
       }
       
       item * reti = p->next_item();
@@ -177,6 +206,21 @@ namespace virtdb { namespace utils {
       assert( (count+p->free_items_) <= p->allocated_items_ );
       p->free_items_ += count;
     }
+    
+    // gives back n items at p if they are the last allocation, returns
+    // false otherwise
+    template <typename T>
+    bool reuse(T * p, size_t n)
+    {
+      if( !p || !n ) return false;
+      size_t count = item_count<T>(n);
+      mempool * l = last();
+      item * end = reinterpret_cast<item *>(p)+count;
+      if( end != l->next_item() ) return false;
+      assert( (count+l->free_items_) <= l->allocated_items_ );
+      l->free_items_ += count;
+      return true;
+    }
   };
 
 }}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <utils/mempool.hh>
+#include <type_traits>
+#include <cstddef>
+
+namespace virtdb { namespace utils {
+
+  // standard allocator on a mempool, so containers can live on the pool
+  // and be dropped at once with it. deallocate() only gives back the last
+  // allocation of the pool, everything else is kept till the pool is
+  // cleared. allocators compare equal when they share the pool, and the
+  // pool moves with the containers on assignment and swap. the pool must
+  // outlive the containers and is not thread safe.
+  template <typename T>
+  class mempool_allocator
+  {
+    template <typename U> friend class mempool_allocator;
+    
+    mempool * pool_;
+    
+  public:
+    typedef T              value_type;
+    typedef T *            pointer;
+    typedef const T *      const_pointer;
+    typedef T &            reference;
+    typedef const T &      const_reference;
+    typedef size_t         size_type;
+    typedef std::ptrdiff_t difference_type;
+    
+    typedef std::true_type   propagate_on_container_copy_assignment;
+    typedef std::true_type   propagate_on_container_move_assignment;
+    typedef std::true_type   propagate_on_container_swap;
+    typedef std::false_type  is_always_equal;
+    
+    template <typename U>
+    struct rebind
+    {
+      typedef mempool_allocator<U> other;
+    };
+    
+    explicit mempool_allocator(mempool & pool) : pool_(&pool) {}
+    
+    template <typename U>
+    mempool_allocator(const mempool_allocator<U> & other) : pool_(other.pool_) {}
+    
+    T * allocate(size_t n)
+    {
+      // checked here, so the allocator works with incomplete types
+      static_assert(alignof(T) <= mempool::item_size(),
+                    "mempool cannot align T");
+      if( !n ) return nullptr;
+      return pool_->allocate<T>(n);
+    }
+    
+    void deallocate(T * p, size_t n)
+    {
+      pool_->reuse<T>(p, n);
+    }
+    
+    mempool & pool() const { return *pool_; }
+    
+    template <typename U>
+    bool operator==(const mempool_allocator<U> & other) const
+    {
+      return pool_ == other.pool_;
+    }
+    
+    template <typename U>
+    bool operator!=(const mempool_allocator<U> & other) const
+    {
+      return pool_ != other.pool_;
+    }
+  };
+  
+}}
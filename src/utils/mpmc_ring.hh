@@ -0,0 +1,161 @@
+#pragma once
+
+#include <utils/constants.hh>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <vector>
+
+namespace virtdb { namespace utils {
+
+  // bounded lock-free multi-producer multi-consumer queue. every slot
+  // carries a sequence number that tells whether it is ready to be
+  // written or read at a given position, so producers and consumers
+  // only contend on the head_ and tail_ counters. these are kept on
+  // separate cache lines.
+  template <typename ITEM>
+  class mpmc_ring final
+  {
+    typedef std::atomic<size_t> counter;
+    
+    struct slot
+    {
+      counter  seq_;
+      ITEM     item_;
+    };
+    
+    struct padded_counter
+    {
+      counter  value_;
+      char     pad_[CACHE_LINE_SIZE-sizeof(counter)];
+    };
+    
+    char                      pad0_[CACHE_LINE_SIZE];
+    padded_counter            head_;
+    padded_counter            tail_;
+    size_t                    mask_;
+    std::unique_ptr<slot []>  slots_;
+    
+    mpmc_ring() = delete;
+    mpmc_ring(const mpmc_ring &) = delete;
+    mpmc_ring & operator=(const mpmc_ring &) = delete;
+    
+    static size_t round_up(size_t capacity)
+    {
+      size_t ret = 2;
+      while( ret < capacity ) ret <<= 1;
+      return ret;
+    }
+    
+  public:
+    // the capacity is rounded up to the next power of two
+    mpmc_ring(size_t capacity, size_t=0)
+    : mask_(round_up(capacity?capacity:DEFAULT_RING_CAPACITY)-1),
+      slots_(new slot[mask_+1])
+    {
+      for( size_t i=0; i<=mask_; ++i )
+        slots_[i].seq_.store(i, std::memory_order_relaxed);
+      head_.value_.store(0, std::memory_order_relaxed);
+      tail_.value_.store(0, std::memory_order_relaxed);
+    }
+    
+    // all workers share the same ring
+    void attach_worker(size_t) {}
+    void detach_worker() {}
+    
+    size_t capacity() const { return mask_+1; }
+    
+    // the item is only consumed when the push succeeds
+    template <typename T>
+    bool try_push(T && i)
+    {
+      size_t pos = head_.value_.load(std::memory_order_relaxed);
+      while( true )
+      {
+        slot & s = slots_[pos & mask_];
+        size_t seq = s.seq_.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if( diff == 0 )
+        {
+          // the slot is free for this position, try to claim it
+          if( head_.value_.compare_exchange_weak(pos, pos+1,
+                                                 std::memory_order_relaxed) )
+          {
+            s.item_ = std::forward<T>(i);
+            s.seq_.store(pos+1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if( diff < 0 )
+        {
+          // the slot was not consumed yet: the ring is full
+          return false;
+        }
+        else
+        {
+          pos = head_.value_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+    
+    // returns the position of the first item that was not pushed
+    template <typename IT>
+    IT try_push_bulk(IT first, IT last)
+    {
+      for( ; first != last; ++first )
+        if( !try_push(*first) )
+          break;
+      return first;
+    }
+    
+    bool try_pop(ITEM & i)
+    {
+      size_t pos = tail_.value_.load(std::memory_order_relaxed);
+      while( true )
+      {
+        slot & s = slots_[pos & mask_];
+        size_t seq = s.seq_.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+        if( diff == 0 )
+        {
+          if( tail_.value_.compare_exchange_weak(pos, pos+1,
+                                                 std::memory_order_relaxed) )
+          {
+            i = std::move(s.item_);
+            // make the slot available for the producer one lap ahead
+            s.seq_.store(pos+mask_+1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if( diff < 0 )
+        {
+          // nothing was published at this position yet: empty
+          return false;
+        }
+        else
+        {
+          pos = tail_.value_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+    
+    size_t try_pop_bulk(std::vector<ITEM> & out, size_t max_items)
+    {
+      size_t ret = 0;
+      ITEM tmp;
+      while( ret < max_items && try_pop(tmp) )
+      {
+        out.push_back(std::move(tmp));
+        ++ret;
+      }
+      return ret;
+    }
+    
+    bool empty() const
+    {
+      return (head_.value_.load(std::memory_order_acquire) ==
+              tail_.value_.load(std::memory_order_acquire));
+    }
+  };
+
+}}
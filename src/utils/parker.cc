@@ -0,0 +1,153 @@
+#include <utils/parker.hh>
+#ifdef UTILS_LINUX_BUILD
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+namespace virtdb { namespace utils {
+  
+  namespace
+  {
+    const int SPIN_COUNT = 128;
+
+#ifdef UTILS_LINUX_BUILD
+    int * futex_addr(std::atomic<uint32_t> & a)
+    {
+      return reinterpret_cast<int *>(&a);
+    }
+    
+    void futex_wait(std::atomic<uint32_t> & a,
+                    uint32_t val,
+                    const struct timespec * timeout)
+    {
+      syscall(SYS_futex, futex_addr(a), FUTEX_WAIT_PRIVATE, val, timeout, 0, 0);
+    }
+    
+    void futex_wake(std::atomic<uint32_t> & a, int n)
+    {
+      syscall(SYS_futex, futex_addr(a), FUTEX_WAKE_PRIVATE, n, 0, 0, 0);
+    }
+#endif
+  }
+  
+  parker::parker()
+  : epoch_{0},
+    waiting_{0}
+  {
+  }
+  
+  parker::ticket
+  parker::prepare_park()
+  {
+    // the increment is ordered before the caller rechecks its condition,
+    // so a notifier either sees us waiting or we see its change
+    waiting_.fetch_add(1);
+    return epoch_.load();
+  }
+  
+  void
+  parker::cancel_park()
+  {
+    waiting_.fetch_sub(1);
+  }
+  
+  bool
+  parker::spin(ticket t) const
+  {
+    for( int i=0; i<SPIN_COUNT; ++i )
+    {
+      if( epoch_.load(std::memory_order_acquire) != t )
+        return true;
+    }
+    return false;
+  }
+  
+  void
+  parker::park(ticket t)
+  {
+    if( !spin(t) )
+    {
+#ifdef UTILS_LINUX_BUILD
+      while( epoch_.load() == t )
+        futex_wait(epoch_, t, nullptr);
+#else
+      lock l(mtx_);
+      while( epoch_.load() == t )
+        cond_.wait(l);
+#endif
+    }
+    waiting_.fetch_sub(1);
+  }
+  
+  bool
+  parker::park_until(ticket t, const time_point_t & deadline)
+  {
+    using namespace std::chrono;
+    bool ret = spin(t);
+    if( !ret )
+    {
+#ifdef UTILS_LINUX_BUILD
+      while( !(ret = (epoch_.load() != t)) )
+      {
+        auto left = deadline - steady_clock::now();
+        if( left <= steady_clock::duration::zero() )
+          break;
+        auto left_ns = duration_cast<nanoseconds>(left).count();
+        struct timespec ts;
+        ts.tv_sec  = left_ns / 1000000000;
+        ts.tv_nsec = left_ns % 1000000000;
+        futex_wait(epoch_, t, &ts);
+      }
+#else
+      lock l(mtx_);
+      ret = cond_.wait_until(l, deadline, [this,t]() {
+        return epoch_.load() != t;
+      });
+#endif
+    }
+    waiting_.fetch_sub(1);
+    return ret;
+  }
+  
+  void
+  parker::wake(bool all)
+  {
+    // pairs with prepare_park(): the caller's state change must be
+    // visible before we read waiting_
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if( waiting_.load() == 0 )
+      return;
+#ifdef UTILS_LINUX_BUILD
+    epoch_.fetch_add(1);
+    futex_wake(epoch_, all ? INT32_MAX : 1);
+#else
+    {
+      lock l(mtx_);
+      epoch_.fetch_add(1);
+    }
+    if( all ) cond_.notify_all();
+    else      cond_.notify_one();
+#endif
+  }
+  
+  void
+  parker::unpark_one()
+  {
+    wake(false);
+  }
+  
+  void
+  parker::unpark_all()
+  {
+    wake(true);
+  }
+  
+  uint32_t
+  parker::waiting() const
+  {
+    return waiting_.load();
+  }
+  
+}}
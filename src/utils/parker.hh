@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+namespace virtdb { namespace utils {
+
+  // parker lets threads sleep until another thread changes the state they
+  // wait for, without timed polling. the waiter announces itself with
+  // prepare_park(), rechecks its condition and then parks with the
+  // returned ticket. the notifier changes the state first, then calls
+  // unpark_one() or unpark_all(), which are a single atomic load when
+  // nobody is waiting. on linux the threads sleep on a futex, elsewhere
+  // on a condition variable.
+  class parker final
+  {
+  public:
+    typedef uint32_t                               ticket;
+    typedef std::chrono::steady_clock::time_point  time_point_t;
+    
+  private:
+    typedef std::unique_lock<std::mutex> lock;
+    
+    std::atomic<uint32_t>     epoch_;
+    std::atomic<uint32_t>     waiting_;
+    // only used by the non-futex build, but always declared so the layout
+    // does not depend on UTILS_LINUX_BUILD, which dependents may not define
+    std::mutex                mtx_;
+    std::condition_variable   cond_;
+    
+    bool spin(ticket t) const;
+    void wake(bool all);
+    
+    parker(const parker &) = delete;
+    parker & operator=(const parker &) = delete;
+    
+  public:
+    parker();
+    
+    ticket prepare_park();
+    void cancel_park();
+    
+    // these return once unpark was called after prepare_park()
+    void park(ticket t);
+    // returns false if the deadline passed without an unpark
+    bool park_until(ticket t, const time_point_t & deadline);
+    
+    void unpark_one();
+    void unpark_all();
+    
+    uint32_t waiting() const;
+  };
+  
+}}
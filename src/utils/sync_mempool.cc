@@ -0,0 +1,278 @@
+#include <utils/sync_mempool.hh>
+#include <algorithm>
+#include <map>
+#include <new>
+
+namespace virtdb { namespace utils {
+
+  namespace
+  {
+    std::atomic<uint64_t> next_pool_id{1};
+    
+    // the live pools by id, so an exiting thread only returns its caches
+    // to pools that still exist. never destroyed, as threads may exit
+    // during the static destruction.
+    struct pool_registry
+    {
+      std::mutex                          mtx_;
+      std::map<uint64_t, sync_mempool *>  pools_;
+    };
+    
+    pool_registry & registry()
+    {
+      static pool_registry * r = new pool_registry;
+      return *r;
+    }
+  }
+  
+  struct sync_mempool::thread_caches
+  {
+    std::map<uint64_t, cache *>  caches_;
+    
+    ~thread_caches()
+    {
+      pool_registry & r = registry();
+      std::lock_guard<std::mutex> l(r.mtx_);
+      for( auto & c : caches_ )
+      {
+        auto it = r.pools_.find(c.first);
+        if( it != r.pools_.end() )
+          it->second->retire(c.second);
+      }
+    }
+    
+    // drops the entries of the destroyed pools
+    void prune()
+    {
+      pool_registry & r = registry();
+      std::lock_guard<std::mutex> l(r.mtx_);
+      auto it = caches_.begin();
+      while( it != caches_.end() )
+      {
+        if( r.pools_.count(it->first) )
+          ++it;
+        else
+          it = caches_.erase(it);
+      }
+    }
+  };
+  
+  sync_mempool::free_list::free_list()
+  : head_(nullptr),
+    size_(0)
+  {
+  }
+  
+  void
+  sync_mempool::free_list::push(void * p)
+  {
+    free_node * n = static_cast<free_node *>(p);
+    n->next_ = head_;
+    head_ = n;
+    ++size_;
+  }
+  
+  void *
+  sync_mempool::free_list::pop()
+  {
+    free_node * n = head_;
+    head_ = n->next_;
+    --size_;
+    return n;
+  }
+  
+  sync_mempool::cache::cache()
+  : pos_(nullptr),
+    free_bytes_(0)
+  {
+  }
+  
+  sync_mempool::sync_mempool(size_t chunk_size)
+  : id_(next_pool_id.fetch_add(1)),
+    chunk_size_(std::max(chunk_size, max_class_size())),
+    allocated_bytes_{0}
+  {
+    for( auto & n : n_shared_ )
+      n = 0;
+      
+    pool_registry & r = registry();
+    std::lock_guard<std::mutex> l(r.mtx_);
+    r.pools_[id_] = this;
+  }
+  
+  sync_mempool::~sync_mempool()
+  {
+    // an exiting thread holds the registry lock while it returns its cache
+    pool_registry & r = registry();
+    std::lock_guard<std::mutex> l(r.mtx_);
+    r.pools_.erase(id_);
+  }
+  
+  sync_mempool::cache &
+  sync_mempool::local()
+  {
+    // pool ids are never reused, so a destroyed pool's id is never
+    // looked up again
+    static thread_local uint64_t       last_id = 0;
+    static thread_local cache *        last = nullptr;
+    
+    if( last_id == id_ )
+      return *last;
+      
+    static thread_local thread_caches  mine;
+    auto it = mine.caches_.find(id_);
+    if( it == mine.caches_.end() )
+    {
+      cache * c = nullptr;
+      {
+        std::lock_guard<std::mutex> l(mtx_);
+        caches_.push_back(cache_ptr{new cache});
+        c = caches_.back().get();
+        // go on with the chunk an exited thread left
+        if( !spares_.empty() )
+        {
+          c->pos_ = spares_.back().pos_;
+          c->free_bytes_ = spares_.back().free_bytes_;
+          spares_.pop_back();
+        }
+      }
+      mine.prune();
+      it = mine.caches_.insert(std::make_pair(id_, c)).first;
+    }
+    last_id = id_;
+    last = it->second;
+    return *last;
+  }
+  
+  void
+  sync_mempool::retire(cache * c)
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    for( size_t cls=0; cls<n_classes; ++cls )
+    {
+      while( c->lists_[cls].head_ )
+        shared_[cls].push(c->lists_[cls].pop());
+      n_shared_[cls] = shared_[cls].size_;
+    }
+    if( c->free_bytes_ >= class_size(0) )
+      spares_.push_back(spare_chunk{c->pos_, c->free_bytes_});
+      
+    auto it = std::find_if(caches_.begin(), caches_.end(),
+                           [c](const cache_ptr & p) { return p.get() == c; });
+    if( it != caches_.end() )
+      caches_.erase(it);
+  }
+  
+  void
+  sync_mempool::refill_chunk(cache & c, size_t n)
+  {
+    // the rest of the old chunk is smaller than the requested class. the
+    // chunks of exited threads are used up first.
+    {
+      std::lock_guard<std::mutex> l(mtx_);
+      while( !spares_.empty() )
+      {
+        spare_chunk sp = spares_.back();
+        spares_.pop_back();
+        if( sp.free_bytes_ >= n )
+        {
+          c.pos_ = sp.pos_;
+          c.free_bytes_ = sp.free_bytes_;
+          return;
+        }
+      }
+    }
+    
+    size_t n_items = (chunk_size_+sizeof(item)-1)/sizeof(item);
+    chunk_ptr chunk{new item[n_items]};
+    c.pos_ = reinterpret_cast<char *>(chunk.get());
+    c.free_bytes_ = n_items*sizeof(item);
+    allocated_bytes_ += c.free_bytes_;
+    
+    std::lock_guard<std::mutex> l(mtx_);
+    chunks_.push_back(std::move(chunk));
+  }
+  
+  bool
+  sync_mempool::refill_list(cache & c, size_t cls)
+  {
+    if( !n_shared_[cls].load(std::memory_order_relaxed) )
+      return false;
+      
+    std::lock_guard<std::mutex> l(mtx_);
+    free_list & from = shared_[cls];
+    for( size_t i=0; i<max_cached/2 && from.head_; ++i )
+      c.lists_[cls].push(from.pop());
+    n_shared_[cls] = from.size_;
+    return c.lists_[cls].head_ != nullptr;
+  }
+  
+  void
+  sync_mempool::flush_list(cache & c, size_t cls)
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    free_list & to = shared_[cls];
+    while( c.lists_[cls].size_ > max_cached/2 )
+      to.push(c.lists_[cls].pop());
+    n_shared_[cls] = to.size_;
+  }
+  
+  void *
+  sync_mempool::allocate_bytes(size_t n)
+  {
+    if( n > max_class_size() )
+      return ::operator new(n);
+      
+    size_t cls = class_of(n);
+    cache & c = local();
+    free_list & fl = c.lists_[cls];
+    if( fl.head_ || refill_list(c, cls) )
+      return fl.pop();
+      
+    size_t sz = class_size(cls);
+    if( c.free_bytes_ < sz )
+      refill_chunk(c, sz);
+      
+    void * ret = c.pos_;
+    c.pos_ += sz;
+    c.free_bytes_ -= sz;
+    return ret;
+  }
+  
+  void
+  sync_mempool::deallocate_bytes(void * p, size_t n)
+  {
+    if( !p ) return;
+    if( n > max_class_size() )
+    {
+      ::operator delete(p);
+      return;
+    }
+    
+    size_t cls = class_of(n);
+    cache & c = local();
+    c.lists_[cls].push(p);
+    if( c.lists_[cls].size_ > max_cached )
+      flush_list(c, cls);
+  }
+  
+  size_t
+  sync_mempool::allocated_bytes() const
+  {
+    return allocated_bytes_.load();
+  }
+  
+  size_t
+  sync_mempool::chunk_size() const
+  {
+    return chunk_size_;
+  }
+  
+  size_t
+  sync_mempool::class_of(size_t n)
+  {
+    if( n <= class_size(0) ) return 0;
+    return 64 - __builtin_clzll(n-1) - 3;
+  }
+  
+}}
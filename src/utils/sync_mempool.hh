@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace virtdb { namespace utils {
+
+  // sync_mempool is the thread safe variant of mempool. every thread bump
+  // allocates from its own chunk taken from the shared chunk list, so the
+  // fast path takes no lock. unlike mempool the memory can be freed: it
+  // goes to the thread's free list of its power of two size class and the
+  // overflow of those lists is moved to shared lists, where other threads
+  // pick it up. when a thread exits, its free lists and the rest of its
+  // chunk go back to the pool for the other threads. requests above
+  // max_class_size() are passed to operator new. the chunks are released
+  // with the pool, no thread may use it after that.
+  class sync_mempool final
+  {
+    // the chosen integral type is the alignment of the allocated memory,
+    // like in mempool
+    typedef long long item;
+    
+    static const size_t n_classes    = 10;   // 8 .. 4096 bytes
+    static const size_t max_cached   = 256;  // per thread and size class
+    
+    struct free_node
+    {
+      free_node * next_;
+    };
+    
+    struct free_list
+    {
+      free_node * head_;
+      size_t      size_;
+      
+      free_list();
+      void push(void * p);
+      void * pop();
+    };
+    
+    struct cache
+    {
+      char *      pos_;
+      size_t      free_bytes_;
+      free_list   lists_[n_classes];
+      
+      cache();
+    };
+    
+    // the unused end of a chunk left behind by an exited thread
+    struct spare_chunk
+    {
+      char *      pos_;
+      size_t      free_bytes_;
+    };
+    
+    // the caches of the calling thread, returned to their live pools at
+    // thread exit
+    struct thread_caches;
+    
+    typedef std::unique_ptr<item[]>  chunk_ptr;
+    typedef std::unique_ptr<cache>   cache_ptr;
+    
+    const uint64_t            id_;
+    const size_t              chunk_size_;
+    std::mutex                mtx_;
+    std::vector<chunk_ptr>    chunks_;
+    std::vector<cache_ptr>    caches_;
+    std::vector<spare_chunk>  spares_;
+    free_list                 shared_[n_classes];
+    std::atomic<size_t>       n_shared_[n_classes];
+    std::atomic<size_t>       allocated_bytes_;
+    
+    cache & local();
+    // moves the cache of an exiting thread to the shared lists
+    void retire(cache * c);
+    void refill_chunk(cache & c, size_t n);
+    bool refill_list(cache & c, size_t cls);
+    void flush_list(cache & c, size_t cls);
+    
+    sync_mempool() = delete;
+    sync_mempool(const sync_mempool &) = delete;
+    sync_mempool & operator=(const sync_mempool &) = delete;
+    
+  public:
+    typedef std::shared_ptr<sync_mempool> sptr;
+    
+    // chunk_size is raised to max_class_size() at least
+    explicit sync_mempool(size_t chunk_size);
+    ~sync_mempool();
+    
+    void * allocate_bytes(size_t n);
+    // n must be the size passed to allocate_bytes()
+    void deallocate_bytes(void * p, size_t n);
+    
+    template <typename T>
+    T * allocate(size_t n)
+    {
+      // the size classes are only aligned to item
+      static_assert(alignof(T) <= alignof(item),
+                    "sync_mempool cannot align T");
+      return static_cast<T *>(allocate_bytes(n*sizeof(T)));
+    }
+    
+    template <typename T>
+    void deallocate(T * p, size_t n)
+    {
+      deallocate_bytes(p, n*sizeof(T));
+    }
+    
+    // the bytes of the chunks, the large allocations are not counted
+    size_t allocated_bytes() const;
+    size_t chunk_size() const;
+    
+    static size_t class_of(size_t n);
+    static constexpr size_t class_size(size_t cls) { return size_t{8} << cls; }
+    static constexpr size_t max_class_size() { return class_size(n_classes-1); }
+  };
+  
+}}
@@ -3,18 +3,101 @@
 #include <utils/relative_time.hh>
 #include <utils/exception.hh>
 #include <utils/constants.hh>
+#include <utils/block_window.hh>
+#include <utils/parker.hh>
+#include <utils/timer_service.hh>
 
+#include <algorithm>
 #include <map>
+#include <set>
+#include <deque>
 #include <vector>
 #include <memory>
 #include <atomic>
-#include <condition_variable>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
 #include <chrono>
 #include <iostream>
+#include <type_traits>
+#include <new>
+#include <cstddef>
 
 namespace virtdb { namespace utils {
 
+  // what insert() does when a new block would exceed the budget
+  enum class collector_overflow
+  {
+    block,          // wait for blocks to be removed, up to block_timeout_ms_
+    evict_oldest,   // drop the lowest block id to make room
+  };
+  
+  // why table_collector::scanner::next() returned
+  enum class scan_status
+  {
+    ready,          // a complete block was returned
+    end,            // the end of the range was reached
+    incomplete,     // timed out, the block at the position is partial
+    missing,        // timed out, there is no block at the position. it was
+                    // not inserted yet or erased, evicted or expired before
+    dropped,        // evicted or expired while waiting, the partial block
+                    // was returned and the position moved on
+    stopped,        // the collector was stopped
+  };
+  
+  struct table_collector_options
+  {
+    // blocks are indexed directly by id in a sliding window of this many
+    // ids above the lowest stored block, others go to a map. 0 keeps
+    // every block in the map.
+    size_t               block_window_;
+    // blocks are spread over this many separately locked stripes by
+    // block_id % n_stripes_, so inserts into different blocks and readers
+    // of different blocks rarely contend
+    size_t               n_stripes_;
+    // budget for the stored blocks, 0 means unlimited. it is checked when
+    // a new block is created, columns of existing blocks are always
+    // accepted so the started blocks can complete.
+    size_t               max_blocks_;
+    size_t               max_bytes_;
+    collector_overflow   overflow_;
+    uint64_t             block_timeout_ms_;
+    // get() of a complete block removes it, like take()
+    bool                 release_on_get_;
+    // with a ttl a background reaper expires the incomplete blocks that
+    // were not updated for this long, see expire_stale()
+    uint64_t             stale_ttl_ms_;
+    // inserts into blocks at or beyond lowest_incomplete()+window wait
+    // till the lower blocks complete, up to block_timeout_ms_. block ids
+    // are expected to start at first_block_id_. 0 turns this off.
+    size_t               admission_window_;
+    size_t               first_block_id_;
+    
+    table_collector_options()
+    : block_window_(DEFAULT_BLOCK_WINDOW),
+      n_stripes_(1),
+      max_blocks_(0),
+      max_bytes_(0),
+      overflow_(collector_overflow::block),
+      block_timeout_ms_(10*DEFAULT_TIMEOUT_MS),
+      release_on_get_(false),
+      stale_ttl_ms_(0),
+      admission_window_(0),
+      first_block_id_(0) {}
+  };
+  
+  struct table_collector_usage
+  {
+    size_t     n_blocks_;
+    size_t     n_bytes_;      // as reported by the cell size function
+    uint64_t   n_evicted_;
+    uint64_t   n_expired_;
+  };
+  
+  // readers blocked in get() register for their block and are woken only
+  // when that block completes, on stop() or at their timeout.
+  // CHECK_TIMEOUT_MS only remains for source compatibility.
   template <typename T, size_t CHECK_TIMEOUT_MS=50>
   class table_collector final
   {
@@ -26,11 +109,58 @@ namespace virtdb { namespace utils {
     typedef std::vector<item_sptr>            row_data;
     typedef std::pair<row_data,size_t>        row_data_ret;
     typedef std::shared_ptr<table_collector>  sptr;
+    typedef std::pair<size_t,row_data>        completed_block;
+    typedef std::function<void(size_t block_id, row_data && data)> completion_handler;
+    typedef std::function<size_t(const item &)>  size_function;
+    
+    struct cell
+    {
+      size_t      block_id_;
+      size_t      col_id_;
+      item_sptr   item_;
+    };
     
+    // the filled columns are tracked in a bitset and a counter, so the
+    // counts are O(1) and the missing ids a scan of the bitset
     class block
     {
-      row_data             data_;
-      size_t               n_columns_;
+      // the items of insert_value() are constructed in place in one arena
+      // per block. the cells alias the arena's shared_ptr, so a block costs
+      // two allocations, the arena with its control block and the slots,
+      // instead of one per cell. all cells of the block share the arena's
+      // refcount, and the arena lives till the last cell handed out is
+      // released.
+      class arena
+      {
+        struct slot
+        {
+          typename std::aligned_storage<sizeof(T), alignof(T)>::type  storage_;
+          bool                                                        used_;
+        };
+        
+        size_t                   n_slots_;
+        std::unique_ptr<slot[]>  slots_;
+        
+        arena(const arena &) = delete;
+        arena & operator=(const arena &) = delete;
+        
+      public:
+        arena(size_t n_columns);
+        ~arena();
+        
+        // returns null if the slot is used already, as readers may still
+        // hold its item
+        template <typename V>
+        T * construct(size_t col_id, V && value);
+      };
+      
+      row_data               data_;
+      size_t                 n_columns_;
+      size_t                 filled_;
+      std::vector<uint64_t>  filled_bits_;
+      size_t                 n_bytes_;
+      uint64_t               last_updated_ms_;
+      std::shared_ptr<arena> arena_;
       
     public:
       block(const block & other);
@@ -44,15 +174,25 @@ namespace virtdb { namespace utils {
       void reset();
       size_t count_non_nil() const;
       size_t count_nil() const;
+      bool complete() const;
+      std::vector<size_t> missing_column_ids() const;
+      size_t n_bytes() const;
+      void n_bytes(size_t n);
 
       void set_col(size_t col_id,
                    item_sptr b);
       
+      // an item for col_id in the arena, falls back to a separate
+      // allocation when the column is set again
+      template <typename V>
+      item_sptr make_item(size_t col_id, V && value);
+      
     private:
       block() = delete;
     };
     
-    table_collector(size_t n_columns);
+    table_collector(size_t n_columns,
+                    const table_collector_options & options=table_collector_options());
     virtual ~table_collector();
     void stop();
     bool stopped() const;
@@ -62,24 +202,235 @@ namespace virtdb { namespace utils {
     void insert(size_t block_id,
                 size_t col_id,
                 item_ptr b);
+    // sets the columns from first_col_id on to the items of [first,last)
+    // under a single lock and lookup
+    template <typename IT>
+    void insert_columns(size_t block_id,
+                        size_t first_col_id,
+                        IT first,
+                        IT last);
+    // constructs the item from value in the block's arena, without an
+    // allocation and refcount of its own
+    template <typename V>
+    void insert_value(size_t block_id,
+                      size_t col_id,
+                      V && value);
+    // inserts cells of any blocks, taking each stripe's lock once per run
+    // of cells in it and looking each block up once per run of its cells.
+    // the cells are moved from and cleared. when waiting for the admission
+    // window or the budget throws, the cells before the failing block are
+    // applied and removed from cells, the rest are left untouched, and the
+    // blocks completed so far are still handed over in push mode.
+    void insert_batch(std::vector<cell> & cells);
+    // removes the block, so its memory is released
     void erase(size_t block_id);
+    // sets how the budget measures a cell, sizeof(T) by default. must be
+    // set before the first insert.
+    void cell_size(size_function f);
+    table_collector_usage usage() const;
+    // removes the incomplete blocks not updated for ttl_ms. their readers
+    // get the partial block at once and in-order push mode skips them.
+    // returns the number of blocks expired.
+    size_t expire_stale(uint64_t ttl_ms);
+    // get() copies the block, take() moves a complete block out and
+    // removes it. both return the partial block on timeout or stop.
     row_data_ret get(size_t block_id,
                      uint64_t timeout_ms=10000);
+    row_data_ret take(size_t block_id,
+                      uint64_t timeout_ms=10000);
+    // calls f(const row_data &, filled columns) under the lock without
+    // copying, once the block is complete or the timeout passed. returns
+    // the number of filled columns, f is not called for missing blocks.
+    template <typename F>
+    size_t view(size_t block_id,
+                F f,
+                uint64_t timeout_ms=0) const;
+    // msec on relative_time::instance() of the last insert, 0 if missing
     uint64_t last_updated(size_t block_id) const;
     size_t missing_columns(size_t block_id) const;
+    std::vector<size_t> missing_column_ids(size_t block_id) const;
     size_t max_block_id() const;
     size_t n_columns() const;
     
+    // push mode: every block is moved to the handler and removed as soon
+    // as its last column arrives, so get() and take() no longer see
+    // complete blocks. the handler runs on the inserting thread. with
+    // in_order the blocks are handed over strictly by ascending block_id
+    // starting at first_block_id, one at a time, and the later ones are
+    // held back till their turn. erased, evicted and expired blocks are
+    // skipped. the handler is called without any lock held, so it may
+    // insert into the collector. can only be set once.
+    void on_complete(completion_handler handler,
+                     bool in_order=false,
+                     size_t first_block_id=0);
+    
+    // push mode feeding the blocks to an active_queue of completed_block.
+    // the queue's workers may still reorder them, unless there is one.
+    template <typename QUEUE>
+    void push_to(QUEUE & queue,
+                 bool in_order=false,
+                 size_t first_block_id=0);
+    
+    // true if the block is there and complete
+    bool ready(size_t block_id) const;
+    
+    // the lowest block id that is neither complete nor removed. only
+    // tracked with an admission window.
+    size_t lowest_incomplete() const;
+    
+    // walks the blocks of [from,to) in ascending order. next() waits only
+    // for the block at the position, so a sequential reader is woken once
+    // per block. with release the blocks are taken, otherwise copied.
+    class scanner
+    {
+      table_collector *  collector_;
+      size_t             next_;
+      size_t             end_;
+      bool               release_;
+      scan_status        status_;
+      
+    public:
+      scanner(table_collector & collector,
+              size_t from,
+              size_t to,
+              bool release);
+      
+      // returns true for a complete block. otherwise status() tells why.
+      // the position only moves on a complete or a dropped block, so
+      // next() can be retried, or the block given up on with skip().
+      bool next(size_t & block_id,
+                row_data & data,
+                uint64_t timeout_ms=10000);
+      
+      scan_status status() const;
+      // moves past the block at the position, e.g. a missing one
+      void skip();
+      
+      size_t position() const;
+      bool at_end() const;
+      
+      // the number of complete blocks from the position on, looking at
+      // most k blocks ahead
+      size_t ready_ahead(size_t k) const;
+    };
+    
+    scanner scan(size_t from,
+                 size_t to,
+                 bool release=true);
+    
   private:
     table_collector() = delete;
     table_collector(const table_collector &) = delete;
     table_collector & operator=(const table_collector &) = delete;
     
+    // a reader blocked in get(). when its block is evicted, or handed to
+    // the completion handler in push mode, the reader gets a copy of it
+    // in dropped_. completed_ is set when the block completed, so a
+    // reader that lost it to a competing take() does not wait on.
+    struct waiter
+    {
+      std::condition_variable   cond_;
+      std::unique_ptr<block>    dropped_;
+      bool                      completed_;
+      
+      waiter() : completed_{false} {}
+    };
+    
+    typedef std::multimap<size_t, waiter *>  waiter_map;
+    
+    // stripe i holds the blocks with block_id % n_stripes == i, keyed by
+    // block_id / n_stripes, and the readers waiting for them
+    struct stripe
+    {
+      mutable std::mutex    mtx_;
+      block_window<block>   blocks_;
+      waiter_map            waiters_;
+      char                  pad_[CACHE_LINE_SIZE];
+      
+      stripe(size_t window) : blocks_(window) {}
+    };
+    
+    typedef std::unique_ptr<stripe>   stripe_ptr;
+    typedef std::vector<stripe_ptr>   stripe_vector;
+    
+    stripe & stripe_of(size_t block_id) const;
+    block * find_block(stripe & st, size_t block_id) const;
+    // waits till the block is complete, the timeout passes or we are
+    // stopped. l must hold the stripe's mtx_. an evicted block is
+    // returned from dropped.
+    block * wait_block(stripe & st,
+                       lock & l,
+                       size_t block_id,
+                       uint64_t timeout_ms,
+                       std::unique_ptr<block> & dropped) const;
+    
+    // take() or get() that also tells what was found
+    row_data_ret fetch(size_t block_id,
+                       uint64_t timeout_ms,
+                       bool release,
+                       scan_status & status);
+    
+    void check_columns(size_t col_id, size_t n) const;
+    void update_max_block_id(size_t block_id);
+    
+    // these must be called with the stripe's mtx_ held. acquire_block
+    // finds or creates the block within the budget and may unlock l
+    // while waiting for room.
+    block & acquire_block(stripe & st, lock & l, size_t block_id);
+    void set_cell(block & blk, size_t col_id, item_sptr b);
+    void completed(stripe & st,
+                   size_t block_id,
+                   block & blk,
+                   std::vector<completed_block> & released);
+    void wake_waiters(stripe & st, size_t block_id);
+    row_data remove_block(stripe & st, size_t block_id, block & blk);
+    // gives the readers of the block a copy, as it is about to go
+    void hand_to_waiters(stripe & st, size_t block_id, const block & blk);
+    void drop_block(stripe & st, size_t block_id, block & blk);
+    
+    bool in_window(size_t block_id) const;
+    void wait_for_window(size_t block_id);
+    // moves the low mark of the admission window
+    void mark_done(size_t block_id);
+    
+    bool reserve_block();
+    bool evict_oldest();
+    void wait_for_room(const parker::time_point_t & deadline);
+    
+    // passes a complete block to the completion handler. in order mode
+    // skips over the id of a dropped block.
+    void release(size_t block_id, row_data && data, bool skip=false);
+    
+    // null entries stand for dropped blocks
+    typedef std::map<size_t, std::unique_ptr<row_data>>  pending_map;
+    typedef std::deque<completed_block>                  ready_queue;
+    
+    table_collector_options        options_;
     size_t                         n_columns_;
-    std::map<size_t, block>        blocks_;
-    mutable std::mutex             mtx_;
-    std::condition_variable        cond_;
+    stripe_vector                  stripes_;
+    std::atomic<size_t>            max_block_id_;
     std::atomic<bool>              stop_;
+    completion_handler             on_complete_;
+    std::atomic<bool>              push_mode_;
+    bool                           in_order_;
+    std::mutex                     release_mtx_;
+    pending_map                    pending_;
+    size_t                         next_release_;
+    // the blocks whose turn came, handed over by the delivering thread
+    ready_queue                    ready_;
+    bool                           delivering_;
+    size_function                  cell_size_;
+    std::atomic<size_t>            n_blocks_;
+    std::atomic<size_t>            n_bytes_;
+    std::atomic<uint64_t>          n_evicted_;
+    std::atomic<uint64_t>          n_expired_;
+    parker                         space_parker_;
+    std::atomic<size_t>            low_mark_;
+    std::mutex                     window_mtx_;
+    std::set<size_t>               done_ahead_;
+    parker                         window_parker_;
+    // destroyed first, so the reaper does not outlive the blocks
+    std::unique_ptr<timer_service> reaper_;
   };
   
   // implementation of table_collector::block
@@ -87,14 +438,23 @@ namespace virtdb { namespace utils {
   template <typename T, size_t CHECK_TIMEOUT_MS>
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::block(const block & other)
   : data_{other.data_},
-    n_columns_{other.n_columns_}
+    n_columns_{other.n_columns_},
+    filled_{other.filled_},
+    filled_bits_{other.filled_bits_},
+    n_bytes_{other.n_bytes_},
+    last_updated_ms_{other.last_updated_ms_},
+    arena_{other.arena_}
   {
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::block(size_t n_columns)
   : data_(n_columns, item_sptr()),
-    n_columns_{n_columns}
+    n_columns_{n_columns},
+    filled_{0},
+    filled_bits_((n_columns+63)/64, 0),
+    n_bytes_{0},
+    last_updated_ms_{0}
   {
   }
   
@@ -118,48 +478,263 @@ namespace virtdb { namespace utils {
   {
     for( auto & d : data_ )
       d.reset();
+    for( auto & w : filled_bits_ )
+      w = 0;
+    filled_ = 0;
+    arena_.reset();
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
   size_t
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::count_non_nil() const
   {
-    size_t ret = 0;
-    {
-      for( auto const & r : data_ )
-        if( r.get() ) ++ret;
-    }
-    return ret;
+    return filled_;
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
   size_t
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::count_nil() const
   {
-    size_t ret = 0;
+    return n_columns_-filled_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::complete() const
+  {
+    return filled_ == n_columns_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  std::vector<size_t>
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::missing_column_ids() const
+  {
+    std::vector<size_t> ret;
+    ret.reserve(n_columns_-filled_);
+    for( size_t w=0; w<filled_bits_.size() && ret.size()<n_columns_-filled_; ++w )
     {
-      for( auto const & r : data_ )
-        if( !r.get() ) ++ret;
+      uint64_t missing = ~filled_bits_[w];
+      while( missing )
+      {
+        size_t col_id = w*64 + __builtin_ctzll(missing);
+        if( col_id >= n_columns_ ) break;
+        ret.push_back(col_id);
+        missing &= missing-1;
+      }
     }
     return ret;
   }
 
-
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  uint64_t
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::last_updated_ms() const
+  {
+    return last_updated_ms_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::last_updated_ms(uint64_t last_updated)
+  {
+    last_updated_ms_ = last_updated;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  size_t
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::n_bytes() const
+  {
+    return n_bytes_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::n_bytes(size_t n)
+  {
+    n_bytes_ = n;
+  }
+  
   template <typename T, size_t CHECK_TIMEOUT_MS>
   void
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::set_col(size_t col_id,
                                                       item_sptr b)
   {
-    data_[col_id] = b;
+    uint64_t & word = filled_bits_[col_id/64];
+    uint64_t bit    = uint64_t{1} << (col_id%64);
+    if( b && !(word & bit) )
+    {
+      word |= bit;
+      ++filled_;
+    }
+    else if( !b && (word & bit) )
+    {
+      word &= ~bit;
+      --filled_;
+    }
+    data_[col_id] = std::move(b);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  template <typename V>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::item_sptr
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::make_item(size_t col_id,
+                                                        V && value)
+  {
+    if( !arena_ )
+      arena_ = std::make_shared<arena>(n_columns_);
+    
+    T * p = arena_->construct(col_id, std::forward<V>(value));
+    if( !p )
+      return std::make_shared<T>(std::forward<V>(value));
+    
+    // shares the arena's control block
+    return item_sptr(arena_, p);
+  }
+  
+  // implementation of table_collector::block::arena
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::arena::arena(size_t n_columns)
+  : n_slots_{n_columns},
+    slots_{new slot[n_columns]()}
+  {
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::arena::~arena()
+  {
+    for( size_t i=0; i<n_slots_; ++i )
+    {
+      if( slots_[i].used_ )
+        reinterpret_cast<T *>(&slots_[i].storage_)->~T();
+    }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  template <typename V>
+  T *
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::block::arena::construct(size_t col_id,
+                                                               V && value)
+  {
+    // new[] only aligns to the fundamental alignment before C++17
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "insert_value() does not support over-aligned items");
+    
+    slot & sl = slots_[col_id];
+    if( sl.used_ ) return nullptr;
+    T * ret = new (&sl.storage_) T(std::forward<V>(value));
+    sl.used_ = true;
+    return ret;
+  }
+  
+  // implementation of table_collector::scanner
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::scanner(table_collector & collector,
+                                                        size_t from,
+                                                        size_t to,
+                                                        bool release)
+  : collector_{&collector},
+    next_{from},
+    end_{std::max(from, to)},
+    release_{release},
+    status_{scan_status::incomplete}
+  {
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::next(size_t & block_id,
+                                                     row_data & data,
+                                                     uint64_t timeout_ms)
+  {
+    if( at_end() )
+    {
+      status_ = scan_status::end;
+      return false;
+    }
+    
+    row_data_ret ret = collector_->fetch(next_, timeout_ms, release_, status_);
+    if( status_ != scan_status::ready && status_ != scan_status::dropped )
+      return false;
+    
+    block_id = next_++;
+    data     = std::move(ret.first);
+    return status_ == scan_status::ready;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  scan_status
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::status() const
+  {
+    return status_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::skip()
+  {
+    if( !at_end() )
+      ++next_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  size_t
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::position() const
+  {
+    return next_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::at_end() const
+  {
+    return next_ >= end_;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  size_t
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scanner::ready_ahead(size_t k) const
+  {
+    size_t ret = 0;
+    while( ret < k && next_+ret < end_ && collector_->ready(next_+ret) )
+      ++ret;
+    return ret;
   }
   
   // implementation of table_collector
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
-  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::table_collector(size_t n_columns)
-  : n_columns_{n_columns},
-    stop_{false}
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::table_collector(size_t n_columns,
+                                                                        const table_collector_options & options)
+  : options_(options),
+    n_columns_{n_columns},
+    max_block_id_{0},
+    stop_{false},
+    push_mode_{false},
+    in_order_{false},
+    next_release_{0},
+    delivering_{false},
+    cell_size_{[](const item &) { return sizeof(item); }},
+    n_blocks_{0},
+    n_bytes_{0},
+    n_evicted_{0},
+    n_expired_{0},
+    low_mark_{options.first_block_id_}
   {
+    size_t n = std::max<size_t>(options.n_stripes_, 1);
+    size_t window = (options.block_window_+n-1)/n;
+    for( size_t i=0; i<n; ++i )
+      stripes_.push_back(stripe_ptr{new stripe(window)});
+    
+    if( options_.stale_ttl_ms_ )
+    {
+      uint64_t interval = std::max<uint64_t>(options_.stale_ttl_ms_/2, 1);
+      reaper_.reset(new timer_service(interval));
+      reaper_->schedule(interval, [this]() {
+        expire_stale(options_.stale_ttl_ms_);
+        return !stopped();
+      });
+    }
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
@@ -173,7 +748,14 @@ namespace virtdb { namespace utils {
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::stop()
   {
     stop_ = true;
-    cond_.notify_all();
+    space_parker_.unpark_all();
+    window_parker_.unpark_all();
+    for( auto & st : stripes_ )
+    {
+      lock l(st->mtx_);
+      for( auto & w : st->waiters_ )
+        w.second->cond_.notify_all();
+    }
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
@@ -199,99 +781,765 @@ namespace virtdb { namespace utils {
                                               size_t col_id,
                                               item_sptr b)
   {
-    lock l(mtx_);
+    check_columns(col_id, 1);
+    wait_for_window(block_id);
+    update_max_block_id(block_id);
+    
+    stripe & st = stripe_of(block_id);
+    std::vector<completed_block> released;
+    {
+      lock l(st.mtx_);
+      block & blk = acquire_block(st, l, block_id);
+      set_cell(blk, col_id, std::move(b));
+      blk.last_updated_ms(relative_time::instance().get_msec());
+      if( blk.complete() )
+        completed(st, block_id, blk, released);
+    }
+    
+    for( auto & r : released )
+      release(r.first, std::move(r.second));
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  template <typename V>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::insert_value(size_t block_id,
+                                                    size_t col_id,
+                                                    V && value)
+  {
+    check_columns(col_id, 1);
+    wait_for_window(block_id);
+    update_max_block_id(block_id);
+    
+    stripe & st = stripe_of(block_id);
+    std::vector<completed_block> released;
+    {
+      lock l(st.mtx_);
+      block & blk = acquire_block(st, l, block_id);
+      set_cell(blk, col_id, blk.make_item(col_id, std::forward<V>(value)));
+      blk.last_updated_ms(relative_time::instance().get_msec());
+      if( blk.complete() )
+        completed(st, block_id, blk, released);
+    }
+    
+    for( auto & r : released )
+      release(r.first, std::move(r.second));
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  template <typename IT>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::insert_columns(size_t block_id,
+                                                      size_t first_col_id,
+                                                      IT first,
+                                                      IT last)
+  {
+    size_t n = std::distance(first, last);
+    if( !n ) return;
+    check_columns(first_col_id, n);
+    wait_for_window(block_id);
+    update_max_block_id(block_id);
+    
+    stripe & st = stripe_of(block_id);
+    std::vector<completed_block> released;
+    {
+      lock l(st.mtx_);
+      block & blk = acquire_block(st, l, block_id);
+      size_t col_id = first_col_id;
+      for( ; first != last; ++first )
+        set_cell(blk, col_id++, *first);
+      blk.last_updated_ms(relative_time::instance().get_msec());
+      if( blk.complete() )
+        completed(st, block_id, blk, released);
+    }
+    
+    for( auto & r : released )
+      release(r.first, std::move(r.second));
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::insert_batch(std::vector<cell> & cells)
+  {
+    for( auto const & c : cells )
+      check_columns(c.col_id_, 1);
+    
+    std::vector<completed_block> released;
+    uint64_t now = relative_time::instance().get_msec();
+    auto it = cells.begin();
+    try
+    {
+      while( it != cells.end() )
+      {
+        // keep the stripe locked for the following cells in it and look up
+        // the block once for the following cells of the same block. blocks
+        // beyond the admission window are waited for without the lock, as
+        // earlier cells of the batch may be what moves the window.
+        wait_for_window(it->block_id_);
+        stripe & st = stripe_of(it->block_id_);
+        lock l(st.mtx_);
+        do
+        {
+          size_t block_id = it->block_id_;
+          update_max_block_id(block_id);
+          block & blk = acquire_block(st, l, block_id);
+          for( ; it != cells.end() && it->block_id_ == block_id; ++it )
+            set_cell(blk, it->col_id_, std::move(it->item_));
+          blk.last_updated_ms(now);
+          if( blk.complete() )
+            completed(st, block_id, blk, released);
+        }
+        while( it != cells.end() &&
+               &stripe_of(it->block_id_) == &st &&
+               in_window(it->block_id_) );
+      }
+    }
+    catch( ... )
+    {
+      // the blocks completed so far are already out of the collector
+      cells.erase(cells.begin(), it);
+      for( auto & r : released )
+        release(r.first, std::move(r.second));
+      throw;
+    }
+    cells.clear();
     
+    for( auto & r : released )
+      release(r.first, std::move(r.second));
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::check_columns(size_t col_id,
+                                                     size_t n) const
+  {
     // check for invalid column id
-    if( n_columns_ <= col_id )
+    if( n_columns_ < n || n_columns_-n < col_id )
     {
-      std::cerr << "out of bounds: " << n_columns_ << "<=" << col_id << "\n";
+      std::cerr << "out of bounds: " << n_columns_ << "<" << col_id << "+" << n << "\n";
       THROW_("col_id out of bounds");
     }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::update_max_block_id(size_t block_id)
+  {
+    size_t max_id = max_block_id_.load(std::memory_order_relaxed);
+    while( block_id > max_id &&
+           !max_block_id_.compare_exchange_weak(max_id, block_id) ) {}
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::block &
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::acquire_block(stripe & st,
+                                                     lock & l,
+                                                     size_t block_id)
+  {
+    // check if exists and create if not, within the budget
+    block * blk = find_block(st, block_id);
+    bool has_deadline = false;
+    parker::time_point_t deadline;
+    while( !blk )
+    {
+      bool reserved = reserve_block();
+      if( reserved || stopped() )
+      {
+        if( !reserved ) ++n_blocks_;
+        blk = st.blocks_.emplace(block_id/stripes_.size(), n_columns_).first;
+        break;
+      }
+      
+      // make room without holding our stripe, then look again
+      l.unlock();
+      if( options_.overflow_ == collector_overflow::evict_oldest )
+      {
+        if( !evict_oldest() )
+          std::this_thread::yield();
+      }
+      else
+      {
+        if( !has_deadline )
+        {
+          deadline = (std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(options_.block_timeout_ms_));
+          has_deadline = true;
+        }
+        wait_for_room(deadline);
+      }
+      l.lock();
+      blk = find_block(st, block_id);
+    }
+    return *blk;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::set_cell(block & blk,
+                                                size_t col_id,
+                                                item_sptr b)
+  {
+    item_sptr & cell = blk.data()[col_id];
+    size_t old_bytes = cell ? cell_size_(*cell) : 0;
+    size_t new_bytes = b ? cell_size_(*b) : 0;
+    blk.n_bytes(blk.n_bytes() - old_bytes + new_bytes);
+    n_bytes_ += new_bytes;
+    n_bytes_ -= old_bytes;
+    blk.set_col(col_id, std::move(b));
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::completed(stripe & st,
+                                                 size_t block_id,
+                                                 block & blk,
+                                                 std::vector<completed_block> & released)
+  {
+    mark_done(block_id);
+    
+    // push mode hands the block over once the stripe is unlocked
+    if( push_mode_.load(std::memory_order_acquire) )
+    {
+      if( !st.waiters_.empty() )
+        hand_to_waiters(st, block_id, blk);
+      released.push_back(completed_block{block_id, remove_block(st, block_id, blk)});
+      return;
+    }
+    
+    // waiters are only interested in complete blocks
+    if( !st.waiters_.empty() )
+      wake_waiters(st, block_id);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::in_window(size_t block_id) const
+  {
+    return ( !options_.admission_window_ ||
+             block_id < low_mark_.load()+options_.admission_window_ );
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::wait_for_window(size_t block_id)
+  {
+    if( in_window(block_id) ) return;
     
-    // check if exists and create if not
-    auto it = blocks_.find(block_id);
-    if( it == blocks_.end() )
+    auto deadline = (std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(options_.block_timeout_ms_));
+    while( !stopped() )
     {
-      auto iit = blocks_.insert(std::make_pair(block_id,block(n_columns_)));
-      it = iit.first;
+      parker::ticket t = window_parker_.prepare_park();
+      if( in_window(block_id) || stopped() )
+      {
+        window_parker_.cancel_park();
+        break;
+      }
+      if( !window_parker_.park_until(t, deadline) )
+      {
+        THROW_("block_id beyond the admission window");
+      }
     }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::mark_done(size_t block_id)
+  {
+    if( !options_.admission_window_ ) return;
     
-    it->second.set_col(col_id, b);
+    std::lock_guard<std::mutex> l(window_mtx_);
+    size_t low = low_mark_.load();
+    if( block_id < low ) return;
+    if( block_id > low )
+    {
+      done_ahead_.insert(block_id);
+      return;
+    }
     
-    cond_.notify_all();
+    ++low;
+    auto it = done_ahead_.begin();
+    while( it != done_ahead_.end() && *it == low )
+    {
+      it = done_ahead_.erase(it);
+      ++low;
+    }
+    low_mark_ = low;
+    window_parker_.unpark_all();
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  size_t
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::lowest_incomplete() const
+  {
+    return low_mark_.load();
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::reserve_block()
+  {
+    size_t n = n_blocks_.load();
+    while( true )
+    {
+      if( options_.max_blocks_ && n >= options_.max_blocks_ )
+        return false;
+      if( options_.max_bytes_ && n_bytes_.load() >= options_.max_bytes_ )
+        return false;
+      if( n_blocks_.compare_exchange_weak(n, n+1) )
+        return true;
+    }
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
   void
-  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::erase(size_t block_id)
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::wait_for_room(const parker::time_point_t & deadline)
   {
-    lock l(mtx_);
-    auto it = blocks_.find(block_id);
-    if( it != blocks_.end() )
+    parker::ticket t = space_parker_.prepare_park();
+    bool full = ((options_.max_blocks_ && n_blocks_ >= options_.max_blocks_) ||
+                 (options_.max_bytes_ && n_bytes_ >= options_.max_bytes_));
+    if( !full || stopped() )
+    {
+      space_parker_.cancel_park();
+    }
+    else if( !space_parker_.park_until(t, deadline) )
     {
-      it->second.reset();
+      THROW_("table_collector budget exceeded");
     }
   }
   
   template <typename T, size_t CHECK_TIMEOUT_MS>
-  typename table_collector<T,CHECK_TIMEOUT_MS>::row_data_ret
-  table_collector<T,CHECK_TIMEOUT_MS>::get(size_t block_id,
-                          uint64_t timeout_ms)
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::evict_oldest()
+  {
+    size_t n = stripes_.size();
+    bool found = false;
+    size_t oldest = 0;
+    for( size_t i=0; i<n; ++i )
+    {
+      lock l(stripes_[i]->mtx_);
+      size_t key = 0;
+      if( stripes_[i]->blocks_.lowest(key) && (!found || key*n+i < oldest) )
+      {
+        oldest = key*n+i;
+        found = true;
+      }
+    }
+    if( !found ) return false;
+    
+    {
+      stripe & st = stripe_of(oldest);
+      lock l(st.mtx_);
+      block * blk = find_block(st, oldest);
+      // someone else may have removed it meanwhile
+      if( !blk ) return true;
+      drop_block(st, oldest, *blk);
+      ++n_evicted_;
+    }
+    
+    if( push_mode_ )
+      release(oldest, row_data(), true);
+    return true;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::row_data
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::remove_block(stripe & st,
+                                                    size_t block_id,
+                                                    block & blk)
   {
-    row_data_ret ret{row_data(n_columns_, item_sptr()), 0};
+    // removing an incomplete block lets the admission window move on
+    if( !blk.complete() )
+      mark_done(block_id);
     
+    row_data ret{std::move(blk.data())};
+    n_bytes_ -= blk.n_bytes();
+    --n_blocks_;
+    st.blocks_.erase(block_id / stripes_.size());
+    if( options_.max_blocks_ || options_.max_bytes_ )
+      space_parker_.unpark_all();
+    return ret;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::drop_block(stripe & st,
+                                                  size_t block_id,
+                                                  block & blk)
+  {
+    // the readers of the block get what was there
+    hand_to_waiters(st, block_id, blk);
+    remove_block(st, block_id, blk);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::hand_to_waiters(stripe & st,
+                                                       size_t block_id,
+                                                       const block & blk)
+  {
+    auto range = st.waiters_.equal_range(block_id);
+    for( auto it=range.first; it!=range.second; ++it )
+    {
+      it->second->dropped_.reset(new block(blk));
+      it->second->cond_.notify_all();
+    }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::cell_size(size_function f)
+  {
+    cell_size_ = std::move(f);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  table_collector_usage
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::usage() const
+  {
+    return table_collector_usage{n_blocks_.load(),
+                                 n_bytes_.load(),
+                                 n_evicted_.load(),
+                                 n_expired_.load()};
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  size_t
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::expire_stale(uint64_t ttl_ms)
+  {
+    uint64_t now = relative_time::instance().get_msec();
+    size_t n = stripes_.size();
+    size_t ret = 0;
+    for( size_t i=0; i<n; ++i )
     {
-      // initial check for block state
-      lock l(mtx_);
+      stripe & st = *stripes_[i];
+      std::vector<size_t> stale;
+      {
+        lock l(st.mtx_);
+        st.blocks_.for_each([&](size_t key, block & blk) {
+          if( !blk.complete() &&
+              now >= blk.last_updated_ms() &&
+              now-blk.last_updated_ms() >= ttl_ms )
+          {
+            stale.push_back(key*n+i);
+          }
+        });
+        for( auto id : stale )
+          drop_block(st, id, *find_block(st, id));
+      }
       
-      auto it = blocks_.find(block_id);
-      if( it != blocks_.end() &&
-          it->second.count_non_nil() == n_columns_ )
+      n_expired_ += stale.size();
+      ret += stale.size();
+      if( push_mode_ )
+      {
+        for( auto id : stale )
+          release(id, row_data(), true);
+      }
+    }
+    return ret;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::on_complete(completion_handler handler,
+                                                   bool in_order,
+                                                   size_t first_block_id)
+  {
+    {
+      std::lock_guard<std::mutex> l(release_mtx_);
+      if( push_mode_ )
       {
-        ret.first  = it->second.data();
-        ret.second = it->second.count_non_nil();
-        return ret;
+        THROW_("completion handler already set");
       }
+      on_complete_   = std::move(handler);
+      in_order_      = in_order;
+      next_release_  = first_block_id;
+      push_mode_.store(true, std::memory_order_release);
     }
     
-    auto wait_till = (std::chrono::steady_clock::now() +
-                      std::chrono::milliseconds(timeout_ms));
+    // hand over the blocks that completed before
+    size_t n = stripes_.size();
+    for( size_t i=0; i<n; ++i )
+    {
+      stripe & st = *stripes_[i];
+      std::vector<completed_block> completed;
+      {
+        lock l(st.mtx_);
+        st.blocks_.for_each([&](size_t key, block & blk) {
+          if( blk.complete() )
+            completed.push_back(completed_block{key*n+i, std::move(blk.data())});
+        });
+        for( auto & c : completed )
+          remove_block(st, c.first, *find_block(st, c.first));
+      }
+      for( auto & c : completed )
+        release(c.first, std::move(c.second));
+    }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  template <typename QUEUE>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::push_to(QUEUE & queue,
+                                               bool in_order,
+                                               size_t first_block_id)
+  {
+    on_complete([&queue](size_t block_id, row_data && data) {
+                  queue.push(completed_block{block_id, std::move(data)});
+                },
+                in_order,
+                first_block_id);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::release(size_t block_id,
+                                               row_data && data,
+                                               bool skip)
+  {
+    if( !in_order_ )
+    {
+      if( !skip )
+        on_complete_(block_id, std::move(data));
+      return;
+    }
     
-    while( stopped() == false )
+    lock l(release_mtx_);
+    
+    if( block_id < next_release_ )
+    {
+      // a block that is late for its turn goes out right away
+      if( !skip )
+        ready_.push_back(completed_block{block_id, std::move(data)});
+    }
+    else
     {
-      lock l(mtx_);
-      cond_.wait_for(l, std::chrono::milliseconds(CHECK_TIMEOUT_MS));
+      // a skip leaves a block that completed already in place
+      if( skip )
+        pending_.insert(std::make_pair(block_id, std::unique_ptr<row_data>()));
+      else
+        pending_[block_id].reset(new row_data(std::move(data)));
       
-      auto it = blocks_.find(block_id);
-      if( it != blocks_.end() )
+      auto it = pending_.begin();
+      while( it != pending_.end() && it->first == next_release_ )
       {
-        ret.first  = it->second.data();
-        ret.second = it->second.count_non_nil();
-        if( ret.second == n_columns_ )
-          return ret;
+        if( it->second )
+          ready_.push_back(completed_block{it->first, std::move(*it->second)});
+        it = pending_.erase(it);
+        ++next_release_;
       }
-      
-      if( std::chrono::steady_clock::now() > wait_till )
+    }
+    
+    // one thread at a time hands over the ready blocks, in order and
+    // without the lock, so the handler may call back into the collector.
+    // blocks readied meanwhile, also by the handler, are picked up here.
+    if( delivering_ ) return;
+    delivering_ = true;
+    while( !ready_.empty() )
+    {
+      completed_block next{std::move(ready_.front())};
+      ready_.pop_front();
+      l.unlock();
+      try
+      {
+        on_complete_(next.first, std::move(next.second));
+      }
+      catch( ... )
+      {
+        l.lock();
+        delivering_ = false;
+        throw;
+      }
+      l.lock();
+    }
+    delivering_ = false;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::stripe &
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::stripe_of(size_t block_id) const
+  {
+    return *stripes_[block_id % stripes_.size()];
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::block *
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::find_block(stripe & st,
+                                                  size_t block_id) const
+  {
+    return st.blocks_.find(block_id / stripes_.size());
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::wake_waiters(stripe & st,
+                                                    size_t block_id)
+  {
+    auto range = st.waiters_.equal_range(block_id);
+    for( auto it=range.first; it!=range.second; ++it )
+    {
+      it->second->completed_ = true;
+      it->second->cond_.notify_all();
+    }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  void
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::erase(size_t block_id)
+  {
+    stripe & st = stripe_of(block_id);
+    {
+      lock l(st.mtx_);
+      block * blk = find_block(st, block_id);
+      if( blk )
+        remove_block(st, block_id, *blk);
+      else
+        mark_done(block_id);
+    }
+    
+    // push mode removes the complete blocks, so this one was incomplete
+    // or never inserted, and the in-order stream must not wait for it
+    if( push_mode_ )
+      release(block_id, row_data(), true);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::block *
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::wait_block(stripe & st,
+                                                  lock & l,
+                                                  size_t block_id,
+                                                  uint64_t timeout_ms,
+                                                  std::unique_ptr<block> & dropped) const
+  {
+    block * blk = find_block(st, block_id);
+    if( (blk && blk->complete()) || !timeout_ms || stopped() )
+      return blk;
+    
+    auto wait_till = (std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(timeout_ms));
+    
+    // stop() and insert() notify under the stripe's mtx_, so registering
+    // while holding it means we cannot miss the wakeup
+    waiter w;
+    auto pos = st.waiters_.insert(std::make_pair(block_id, &w));
+    bool timed_out = false;
+    
+    while( !(blk && blk->complete()) && !timed_out && !stopped() )
+    {
+      timed_out = (w.cond_.wait_until(l, wait_till) == std::cv_status::timeout);
+      if( w.dropped_ )
       {
+        dropped = std::move(w.dropped_);
+        blk = dropped.get();
         break;
       }
+      blk = find_block(st, block_id);
+      if( !blk && w.completed_ )
+        break;
+    }
+    
+    st.waiters_.erase(pos);
+    return blk;
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::row_data_ret
+  table_collector<T,CHECK_TIMEOUT_MS>::get(size_t block_id,
+                          uint64_t timeout_ms)
+  {
+    if( options_.release_on_get_ )
+      return take(block_id, timeout_ms);
+    
+    scan_status status;
+    return fetch(block_id, timeout_ms, false, status);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::row_data_ret
+  table_collector<T,CHECK_TIMEOUT_MS>::take(size_t block_id,
+                           uint64_t timeout_ms)
+  {
+    scan_status status;
+    return fetch(block_id, timeout_ms, true, status);
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::row_data_ret
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::fetch(size_t block_id,
+                                             uint64_t timeout_ms,
+                                             bool release,
+                                             scan_status & status)
+  {
+    row_data_ret ret{row_data(), 0};
+    stripe & st = stripe_of(block_id);
+    lock l(st.mtx_);
+    std::unique_ptr<block> dropped;
+    block * blk = wait_block(st, l, block_id, timeout_ms, dropped);
+    if( blk && dropped )
+    {
+      // push mode hands over complete blocks the same way
+      ret.first  = std::move(blk->data());
+      ret.second = blk->count_non_nil();
+      status     = (blk->complete() ? scan_status::ready : scan_status::dropped);
+    }
+    else if( blk && blk->complete() )
+    {
+      ret.second = n_columns_;
+      if( release )
+        ret.first = remove_block(st, block_id, *blk);
+      else
+        ret.first = blk->data();
+      status     = scan_status::ready;
+      return ret;
+    }
+    else if( blk )
+    {
+      // incomplete blocks stay for the producers
+      ret.first  = blk->data();
+      ret.second = blk->count_non_nil();
+      status     = scan_status::incomplete;
     }
+    else
+    {
+      ret.first.resize(n_columns_);
+      status     = scan_status::missing;
+    }
+    if( stopped() && status != scan_status::dropped )
+      status = scan_status::stopped;
     return ret;
   }
   
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  template <typename F>
+  size_t
+  table_collector<T,CHECK_TIMEOUT_MS>::view(size_t block_id,
+                           F f,
+                           uint64_t timeout_ms) const
+  {
+    stripe & st = stripe_of(block_id);
+    lock l(st.mtx_);
+    std::unique_ptr<block> dropped;
+    block * blk = wait_block(st, l, block_id, timeout_ms, dropped);
+    if( !blk ) return 0;
+    const row_data & data = blk->data();
+    f(data, blk->count_non_nil());
+    return blk->count_non_nil();
+  }
+  
   template <typename T, size_t CHECK_TIMEOUT_MS>
   uint64_t
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::last_updated(size_t block_id) const
   {
-    lock l(mtx_);
-    auto it = blocks_.find(block_id);
-    if( it == blocks_.end() )
+    stripe & st = stripe_of(block_id);
+    lock l(st.mtx_);
+    const block * blk = find_block(st, block_id);
+    if( !blk )
     {
       return 0;
     }
     else
     {
-      return it->second.last_updated_ms();
+      return blk->last_updated_ms();
     }
   }
   
@@ -299,28 +1547,64 @@ namespace virtdb { namespace utils {
   size_t
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::missing_columns(size_t block_id) const
   {
-    lock l(mtx_);
-    auto it = blocks_.find(block_id);
-    if( it == blocks_.end() )
+    stripe & st = stripe_of(block_id);
+    lock l(st.mtx_);
+    const block * blk = find_block(st, block_id);
+    if( !blk )
     {
       return n_columns_;
     }
     else
     {
-      return it->second.count_nil();
+      return blk->count_nil();
+    }
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  std::vector<size_t>
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::missing_column_ids(size_t block_id) const
+  {
+    stripe & st = stripe_of(block_id);
+    lock l(st.mtx_);
+    const block * blk = find_block(st, block_id);
+    if( !blk )
+    {
+      std::vector<size_t> ret(n_columns_);
+      for( size_t i=0; i<n_columns_; ++i )
+        ret[i] = i;
+      return ret;
+    }
+    else
+    {
+      return blk->missing_column_ids();
     }
   }
   
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  bool
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::ready(size_t block_id) const
+  {
+    stripe & st = stripe_of(block_id);
+    lock l(st.mtx_);
+    const block * blk = find_block(st, block_id);
+    return blk && blk->complete();
+  }
+  
+  template <typename T, size_t CHECK_TIMEOUT_MS>
+  typename table_collector<T,CHECK_TIMEOUT_MS>::scanner
+  table_collector<T,CHECK_TIMEOUT_MS>::table_collector::scan(size_t from,
+                                            size_t to,
+                                            bool release)
+  {
+    return scanner(*this, from, to, release);
+  }
+  
   template <typename T, size_t CHECK_TIMEOUT_MS>
   size_t
   table_collector<T,CHECK_TIMEOUT_MS>::table_collector::max_block_id() const
   {
-    lock l(mtx_);
-    auto it = blocks_.rbegin();
-    if( it == blocks_.rend() )
-      return 0;
-    else
-      return it->first;
+    // erased blocks still count, as they did with the map
+    return max_block_id_.load();
   }
 
   template <typename T, size_t CHECK_TIMEOUT_MS>
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <utils/constants.hh>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace virtdb { namespace utils {
+
+  // active_queue storage where each worker owns a local deque. items
+  // pushed by a worker thread of this queue go to its own deque and are
+  // taken back in LIFO order, while idle workers steal the oldest items
+  // from the others. other threads push to a shared injection queue.
+  template <typename ITEM>
+  class work_stealing_queue final
+  {
+    typedef std::mutex             mtx;
+    typedef std::lock_guard<mtx>   lock;
+    
+    struct local_queue
+    {
+      mutable mtx        mutex_;
+      std::deque<ITEM>   items_;
+      // keep the neighbouring queues on different cache lines
+      char               pad_[CACHE_LINE_SIZE];
+    };
+    
+    typedef std::unique_ptr<local_queue> local_ptr;
+    
+    struct worker_slot
+    {
+      const work_stealing_queue * owner_;
+      size_t                      index_;
+    };
+    
+    local_queue              injected_;
+    std::vector<local_ptr>   locals_;
+    
+    work_stealing_queue() = delete;
+    work_stealing_queue(const work_stealing_queue &) = delete;
+    work_stealing_queue & operator=(const work_stealing_queue &) = delete;
+    
+    // a worker may serve more than one queue (e.g. active_queue lanes),
+    // so every thread keeps a short list of the queues it is attached to
+    typedef std::vector<worker_slot> slot_vector;
+    
+    static slot_vector & slots()
+    {
+      static thread_local slot_vector s_slots;
+      return s_slots;
+    }
+    
+    // returns the index of the calling thread's deque or -1 if it is
+    // not one of our workers
+    size_t own_index() const
+    {
+      for( auto const & slot : slots() )
+        if( slot.owner_ == this ) return slot.index_;
+      return (size_t)-1;
+    }
+    
+    local_queue * own_queue() const
+    {
+      size_t index = own_index();
+      if( index == (size_t)-1 ) return nullptr;
+      return locals_[index].get();
+    }
+    
+    static size_t pop_front(local_queue & q,
+                            std::vector<ITEM> & out,
+                            size_t max_items)
+    {
+      lock l(q.mutex_);
+      size_t ret = 0;
+      while( ret < max_items && !q.items_.empty() )
+      {
+        out.push_back(std::move(q.items_.front()));
+        q.items_.pop_front();
+        ++ret;
+      }
+      return ret;
+    }
+    
+    static bool pop_front(local_queue & q, ITEM & i)
+    {
+      lock l(q.mutex_);
+      if( q.items_.empty() ) return false;
+      i = std::move(q.items_.front());
+      q.items_.pop_front();
+      return true;
+    }
+    
+  public:
+    // the capacity hint is ignored, the deques grow as needed
+    work_stealing_queue(size_t, size_t n_workers)
+    {
+      for( size_t i=0; i<n_workers; ++i )
+        locals_.push_back(local_ptr{new local_queue});
+    }
+    
+    // must be called by the worker threads before they start popping
+    void attach_worker(size_t index)
+    {
+      slots().push_back(worker_slot{this, index});
+    }
+    
+    void detach_worker()
+    {
+      slot_vector & s = slots();
+      for( auto it=s.begin(); it!=s.end(); ++it )
+      {
+        if( it->owner_ == this )
+        {
+          s.erase(it);
+          return;
+        }
+      }
+    }
+    
+    template <typename T>
+    bool try_push(T && i)
+    {
+      local_queue * q = own_queue();
+      if( !q ) q = &injected_;
+      lock l(q->mutex_);
+      q->items_.push_back(std::forward<T>(i));
+      return true;
+    }
+    
+    // returns the position of the first item that was not pushed
+    template <typename IT>
+    IT try_push_bulk(IT first, IT last)
+    {
+      local_queue * q = own_queue();
+      if( !q ) q = &injected_;
+      lock l(q->mutex_);
+      for( ; first != last; ++first )
+        q->items_.push_back(*first);
+      return first;
+    }
+    
+    // own deque first (newest item), then the injection queue, then
+    // steal the oldest item of another worker
+    bool try_pop(ITEM & i)
+    {
+      size_t index = own_index();
+      size_t start = 0;
+      if( index != (size_t)-1 )
+      {
+        local_queue & own = *locals_[index];
+        {
+          lock l(own.mutex_);
+          if( !own.items_.empty() )
+          {
+            i = std::move(own.items_.back());
+            own.items_.pop_back();
+            return true;
+          }
+        }
+        start = index+1;
+      }
+      
+      if( pop_front(injected_, i) )
+        return true;
+      
+      for( size_t n=0; n<locals_.size(); ++n )
+      {
+        if( pop_front(*locals_[(start+n)%locals_.size()], i) )
+          return true;
+      }
+      return false;
+    }
+    
+    size_t try_pop_bulk(std::vector<ITEM> & out, size_t max_items)
+    {
+      size_t index = own_index();
+      size_t start = 0;
+      size_t ret = 0;
+      if( index != (size_t)-1 )
+      {
+        local_queue & own = *locals_[index];
+        {
+          lock l(own.mutex_);
+          while( ret < max_items && !own.items_.empty() )
+          {
+            out.push_back(std::move(own.items_.back()));
+            own.items_.pop_back();
+            ++ret;
+          }
+        }
+        if( ret ) return ret;
+        start = index+1;
+      }
+      
+      ret = pop_front(injected_, out, max_items);
+      if( ret ) return ret;
+      
+      // steal at most half a batch, so the victim keeps some of its work
+      size_t steal_max = (max_items+1)/2;
+      for( size_t n=0; n<locals_.size(); ++n )
+      {
+        ret = pop_front(*locals_[(start+n)%locals_.size()], out, steal_max);
+        if( ret ) return ret;
+      }
+      return 0;
+    }
+    
+    bool empty() const
+    {
+      {
+        lock l(injected_.mutex_);
+        if( !injected_.items_.empty() ) return false;
+      }
+      for( auto const & q : locals_ )
+      {
+        lock l(q->mutex_);
+        if( !q->items_.empty() ) return false;
+      }
+      return true;
+    }
+  };
+
+}}
@@ -6,6 +6,10 @@
 #include <utils/utf8.hh>
 #include <utils/table_collector.hh>
 #include <utils/relative_time.hh>
+#include <utils/parker.hh>
+#include <utils/histogram.hh>
+#include <utils/sync_mempool.hh>
+#include <utils/mempool_allocator.hh>
 #include <future>
 #include <thread>
 #include <atomic>
@@ -62,10 +66,14 @@ namespace virtdb { namespace test {
     barrier barrier_;
   };
   
+  class UtilParkerTest : public ::testing::Test { };
+  class UtilHistogramTest : public ::testing::Test { };
   class UtilNetTest : public ::testing::Test { };
   class UtilFlexAllocTest : public ::testing::Test { };
+  class UtilMempoolTest : public ::testing::Test { };
   class UtilAsyncWorkerTest : public ::testing::Test { };
   class UtilTableCollectorTest : public ::testing::Test { };
+  class UtilBlockWindowTest : public ::testing::Test { };
   class UtilUtf8Test : public ::testing::Test { };
 }}
 
@@ -124,6 +132,60 @@ TEST_F(UtilTableCollectorTest, MultiThreaded2)
   }
 }
 
+namespace
+{
+  // one producer thread per column and two readers, returns the number
+  // of complete blocks the readers got
+  size_t collector_throughput(size_t n_stripes)
+  {
+    const size_t n_columns = 16;
+    const size_t n_blocks  = 2000;
+    table_collector_options options;
+    options.n_stripes_ = n_stripes;
+    table_collector<int> q{n_columns, options};
+    
+    std::vector<std::thread> producers;
+    for( size_t c=0; c<n_columns; ++c )
+    {
+      producers.push_back(std::thread([&q,c,n_blocks] {
+        for( size_t i=0; i<n_blocks; ++i )
+          q.insert(i, c, std::make_shared<int>((int)(i+c)));
+      }));
+    }
+    
+    std::atomic<size_t> complete{0};
+    auto reader = [&](size_t first) {
+      for( size_t i=first; i<n_blocks; i+=2 )
+      {
+        auto ro = q.get(i,30000);
+        bool ok = (ro.second == n_columns);
+        for( size_t c=0; ok && c<n_columns; ++c )
+          ok = (*ro.first[c] == (int)(i+c));
+        if( ok ) ++complete;
+      }
+    };
+    std::thread even(reader, 0);
+    std::thread odd(reader, 1);
+    
+    for( auto & p : producers ) p.join();
+    even.join();
+    odd.join();
+    return complete;
+  }
+}
+
+TEST_F(UtilTableCollectorTest, MultiThreadedStriped)
+{
+  {
+    MEASURE_ME;
+    EXPECT_EQ(collector_throughput(1), 2000);
+  }
+  {
+    MEASURE_ME;
+    EXPECT_EQ(collector_throughput(16), 2000);
+  }
+}
+
 TEST_F(UtilTableCollectorTest, Basic)
 {
   table_collector<int> q(3);
@@ -236,6 +298,652 @@ TEST_F(UtilTableCollectorTest, AllOps)
   }
 }
 
+TEST_F(UtilTableCollectorTest, StorageModes)
+{
+  table_collector_options map_only;
+  map_only.block_window_ = 0;
+  table_collector_options small;
+  small.block_window_ = 8;
+  
+  for( auto const & opts : { table_collector_options(), map_only, small } )
+  {
+    table_collector<int> q(2, opts);
+    // dense ids, a far away one and one below the window base
+    for( size_t i=100; i<200; ++i )
+    {
+      q.insert(i, 0, new int{(int)i});
+      q.insert(i, 1, new int{(int)i});
+    }
+    q.insert(1000000, 0, new int{1});
+    for( size_t i=100; i<150; ++i )
+      q.erase(i);
+    q.insert(120, 1, new int{120});
+    
+    EXPECT_EQ(q.max_block_id(), 1000000);
+    EXPECT_EQ(q.missing_columns(110), 2);
+    EXPECT_EQ(q.missing_columns(120), 1);
+    EXPECT_EQ(q.missing_columns(1000000), 1);
+    auto row = q.get(199, 1);
+    EXPECT_EQ(row.second, 2);
+    EXPECT_EQ(*row.first[0], 199);
+  }
+}
+
+TEST_F(UtilTableCollectorTest, PerBlockWakeup)
+{
+  table_collector<int> q(2);
+  auto reader = [&q](size_t block_id) {
+    return std::async(std::launch::async, [&q,block_id] {
+      return q.get(block_id, 20000).second;
+    });
+  };
+  auto r0 = reader(0);
+  auto r1 = reader(1);
+  auto r2 = reader(2);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  
+  // incomplete blocks do not wake anyone
+  q.insert(0, 0, new int{0});
+  q.insert(1, 0, new int{1});
+  EXPECT_EQ( r1.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout );
+  
+  q.insert(1, 1, new int{2});
+  ASSERT_EQ( r1.wait_for(std::chrono::milliseconds(5000)), std::future_status::ready );
+  EXPECT_EQ( r1.get(), 2 );
+  EXPECT_EQ( r0.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout );
+  
+  // stop releases the rest with what they have
+  relative_time rt;
+  q.stop();
+  EXPECT_EQ( r0.get(), 1 );
+  EXPECT_EQ( r2.get(), 0 );
+  EXPECT_LT( rt.get_msec(), 5000 );
+}
+
+TEST_F(UtilTableCollectorTest, MissingColumnIds)
+{
+  table_collector<int> q(130);
+  EXPECT_EQ(q.missing_column_ids(0).size(), 130);
+  
+  for( size_t i=0; i<130; ++i )
+    if( i != 3 && i != 64 && i != 129 )
+      q.insert(0, i, new int{(int)i});
+  // overwrites do not count twice
+  q.insert(0, 5, new int{5});
+  
+  EXPECT_EQ(q.missing_columns(0), 3);
+  EXPECT_EQ(q.missing_column_ids(0), (std::vector<size_t>{3, 64, 129}));
+  
+  // clearing a cell makes it missing again
+  q.insert(0, 7, std::shared_ptr<int>());
+  EXPECT_EQ(q.missing_column_ids(0), (std::vector<size_t>{3, 7, 64, 129}));
+  
+  for( size_t i : {3, 7, 64, 129} )
+    q.insert(0, i, new int{(int)i});
+  EXPECT_EQ(q.missing_columns(0), 0);
+  EXPECT_TRUE(q.missing_column_ids(0).empty());
+  EXPECT_EQ(q.get(0, 1).second, 130);
+}
+
+TEST_F(UtilTableCollectorTest, WindowSlidesOverMapBlock)
+{
+  table_collector<int> q(2);
+  for( size_t i=0; i<DEFAULT_BLOCK_WINDOW; ++i )
+  {
+    q.insert(i, 0, new int{0});
+    q.insert(i, 1, new int{1});
+  }
+  // beyond the window, stored in the map
+  q.insert(70000, 0, new int{2});
+  for( size_t i=0; i<=5000; ++i )
+    EXPECT_EQ(q.take(i, 0).second, 2);
+  
+  // 70000 is in the window now, the first column must not get lost
+  q.insert(70000, 1, new int{3});
+  EXPECT_EQ(q.missing_columns(70000), 0);
+  auto row = q.get(70000, 0);
+  EXPECT_EQ(row.second, 2);
+  EXPECT_EQ(*row.first[0], 2);
+}
+
+TEST_F(UtilTableCollectorTest, TakeAndView)
+{
+  table_collector<int> q(2);
+  q.insert(0, 0, new int{1});
+  q.insert(0, 1, new int{2});
+  q.insert(1, 0, new int{3});
+  
+  // view does not copy and leaves the block in place
+  int sum = 0;
+  EXPECT_EQ(q.view(0, [&sum](const table_collector<int>::row_data & row, size_t) {
+    for( auto const & c : row ) sum += *c;
+  }), 2);
+  EXPECT_EQ(sum, 3);
+  EXPECT_EQ(q.view(5, [](const table_collector<int>::row_data &, size_t) { FAIL(); }), 0);
+  
+  // take moves the complete block out and removes it
+  auto row = q.take(0, 1);
+  EXPECT_EQ(row.second, 2);
+  EXPECT_EQ(*row.first[1], 2);
+  EXPECT_EQ(row.first[0].use_count(), 1);
+  EXPECT_EQ(q.missing_columns(0), 2);
+  
+  // an incomplete block stays, the waiting take gets it once complete
+  auto partial = q.take(1, 1);
+  EXPECT_EQ(partial.second, 1);
+  EXPECT_EQ(q.missing_columns(1), 1);
+  auto taker = std::async(std::launch::async, [&q] { return q.take(1, 20000); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  q.insert(1, 1, new int{4});
+  EXPECT_EQ(taker.get().second, 2);
+  EXPECT_EQ(q.missing_columns(1), 2);
+  
+  // of two takers one gets the block, the other returns at once
+  q.insert(2, 0, new int{5});
+  auto first  = std::async(std::launch::async, [&q] { return q.take(2, 20000); });
+  auto second = std::async(std::launch::async, [&q] { return q.take(2, 20000); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  relative_time rt;
+  q.insert(2, 1, new int{6});
+  size_t filled = first.get().second + second.get().second;
+  EXPECT_EQ(filled, 2);
+  EXPECT_LT(rt.get_msec(), 10000);
+}
+
+TEST_F(UtilTableCollectorTest, CompletionCallback)
+{
+  typedef table_collector<int> collector;
+  
+  // unordered: blocks go out as they complete, including the ones that
+  // were complete before the handler was set
+  {
+    collector q(2);
+    q.insert(7, 0, new int{7});
+    q.insert(7, 1, new int{7});
+    std::vector<size_t> ids;
+    q.on_complete([&ids](size_t block_id, collector::row_data && data) {
+      EXPECT_EQ(*data[0], (int)block_id);
+      ids.push_back(block_id);
+    });
+    EXPECT_THROW(q.on_complete([](size_t, collector::row_data &&) {}), std::exception);
+    q.insert(3, 0, new int{3});
+    q.insert(3, 1, new int{3});
+    EXPECT_EQ(ids, (std::vector<size_t>{7, 3}));
+    EXPECT_EQ(q.missing_columns(3), 2);
+  }
+  
+  // in order: later blocks wait for the earlier ones
+  {
+    collector q(2);
+    std::vector<size_t> ids;
+    q.on_complete([&ids](size_t block_id, collector::row_data &&) {
+                    ids.push_back(block_id);
+                  },
+                  true,
+                  10);
+    for( size_t id : {12, 11, 14, 10, 13} )
+    {
+      q.insert(id, 1, new int{(int)id});
+      q.insert(id, 0, new int{(int)id});
+      if( id == 10 )
+      {
+        EXPECT_EQ(ids, (std::vector<size_t>{10, 11, 12}));
+      }
+    }
+    EXPECT_EQ(ids, (std::vector<size_t>{10, 11, 12, 13, 14}));
+  }
+  
+  // in order: an erased block is skipped, and the handler may insert
+  {
+    collector q(2);
+    std::vector<size_t> ids;
+    q.on_complete([&ids,&q](size_t block_id, collector::row_data &&) {
+                    ids.push_back(block_id);
+                    if( block_id == 2 )
+                    {
+                      q.insert(3, 0, new int{3});
+                      q.insert(3, 1, new int{3});
+                    }
+                  },
+                  true);
+    q.insert(0, 0, new int{0});
+    q.insert(1, 0, new int{1});
+    q.insert(1, 1, new int{1});
+    q.insert(2, 0, new int{2});
+    q.insert(2, 1, new int{2});
+    EXPECT_TRUE(ids.empty());
+    q.erase(0);
+    EXPECT_EQ(ids, (std::vector<size_t>{1, 2, 3}));
+  }
+  
+  // in order: erasing an id that never got a column skips it too, and
+  // a completed block waiting for its turn is not lost to an erase
+  {
+    collector q(2);
+    std::vector<size_t> ids;
+    q.on_complete([&ids](size_t block_id, collector::row_data &&) {
+                    ids.push_back(block_id);
+                  },
+                  true);
+    q.insert(2, 0, new int{2});
+    q.insert(2, 1, new int{2});
+    q.erase(2);
+    q.insert(1, 0, new int{1});
+    q.insert(1, 1, new int{1});
+    EXPECT_TRUE(ids.empty());
+    q.erase(0);
+    EXPECT_EQ(ids, (std::vector<size_t>{1, 2}));
+  }
+  
+  // a reader waiting on a block gets it when push mode hands it over
+  {
+    collector q(2);
+    q.on_complete([](size_t, collector::row_data &&) {});
+    q.insert(5, 0, new int{5});
+    auto reader = std::async(std::launch::async, [&q] { return q.get(5, 20000); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    relative_time rt;
+    q.insert(5, 1, new int{6});
+    auto row = reader.get();
+    EXPECT_LT(rt.get_msec(), 10000);
+    EXPECT_EQ(row.second, 2);
+    EXPECT_EQ(*row.first[1], 6);
+  }
+}
+
+TEST_F(UtilTableCollectorTest, PushToActiveQueue)
+{
+  typedef table_collector<int> collector;
+  table_collector_options options;
+  options.n_stripes_ = 4;
+  collector q(3, options);
+  
+  std::vector<size_t> ids;
+  active_queue<collector::completed_block> out{
+    1,
+    [&ids](collector::completed_block b) {
+      EXPECT_EQ(b.second.size(), 3);
+      ids.push_back(b.first);
+    }};
+  q.push_to(out, true);
+  
+  std::vector<std::thread> producers;
+  for( size_t c=0; c<3; ++c )
+  {
+    producers.push_back(std::thread([&q,c] {
+      for( size_t i=0; i<1000; ++i )
+        q.insert(i, c, new int{(int)i});
+    }));
+  }
+  for( auto & p : producers ) p.join();
+  EXPECT_TRUE(out.wait_empty(std::chrono::milliseconds(20000)));
+  
+  ASSERT_EQ(ids.size(), 1000);
+  for( size_t i=0; i<ids.size(); ++i )
+    EXPECT_EQ(ids[i], i);
+}
+
+TEST_F(UtilTableCollectorTest, ReleaseOnGet)
+{
+  table_collector_options options;
+  options.release_on_get_ = true;
+  table_collector<int> q(2, options);
+  for( size_t i=0; i<10; ++i )
+  {
+    q.insert(i, 0, new int{0});
+    q.insert(i, 1, new int{1});
+  }
+  q.insert(10, 0, new int{0});
+  EXPECT_EQ(q.usage().n_blocks_, 11);
+  EXPECT_EQ(q.usage().n_bytes_, 21*sizeof(int));
+  
+  for( size_t i=0; i<10; ++i )
+    EXPECT_EQ(q.get(i, 1).second, 2);
+  // the incomplete block stays
+  EXPECT_EQ(q.get(10, 1).second, 1);
+  EXPECT_EQ(q.usage().n_blocks_, 1);
+  EXPECT_EQ(q.usage().n_bytes_, sizeof(int));
+  q.erase(10);
+  EXPECT_EQ(q.usage().n_blocks_, 0);
+  EXPECT_EQ(q.usage().n_bytes_, 0);
+}
+
+TEST_F(UtilTableCollectorTest, BudgetEvict)
+{
+  table_collector_options options;
+  options.max_blocks_ = 3;
+  options.overflow_   = collector_overflow::evict_oldest;
+  table_collector<int> q(2, options);
+  
+  q.insert(0, 0, new int{0});
+  auto reader = std::async(std::launch::async, [&q] { return q.get(0, 20000).second; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  
+  for( size_t i=1; i<5; ++i )
+    q.insert(i, 0, new int{(int)i});
+  
+  // the reader of the evicted block gets the partial block right away
+  EXPECT_EQ(reader.get(), 1);
+  EXPECT_EQ(q.usage().n_blocks_, 3);
+  EXPECT_EQ(q.usage().n_evicted_, 2);
+  EXPECT_EQ(q.missing_columns(0), 2);
+  EXPECT_EQ(q.missing_columns(1), 2);
+  EXPECT_EQ(q.missing_columns(4), 1);
+  
+  // existing blocks can always complete
+  q.insert(2, 1, new int{2});
+  EXPECT_EQ(q.usage().n_evicted_, 2);
+}
+
+TEST_F(UtilTableCollectorTest, BudgetBlock)
+{
+  table_collector_options options;
+  options.max_bytes_        = 4*sizeof(int);
+  options.block_timeout_ms_ = 500;
+  table_collector<int> q(2, options);
+  
+  q.insert(0, 0, new int{0});
+  q.insert(0, 1, new int{0});
+  q.insert(1, 0, new int{1});
+  q.insert(1, 1, new int{1});
+  EXPECT_THROW(q.insert(2, 0, new int{2}), std::exception);
+  
+  // the producer continues once a block is consumed
+  auto producer = std::async(std::launch::async, [&q] { q.insert(2, 0, new int{2}); });
+  EXPECT_EQ(producer.wait_for(std::chrono::milliseconds(20)), std::future_status::timeout);
+  EXPECT_EQ(q.take(0, 1).second, 2);
+  producer.get();
+  EXPECT_EQ(q.missing_columns(2), 1);
+  EXPECT_EQ(q.usage().n_bytes_, 3*sizeof(int));
+}
+
+TEST_F(UtilTableCollectorTest, StaleReaper)
+{
+  table_collector_options options;
+  options.stale_ttl_ms_ = 50;
+  table_collector<int> q(2, options);
+  
+  uint64_t before = relative_time::instance().get_msec();
+  q.insert(0, 0, new int{0});
+  q.insert(1, 0, new int{1});
+  q.insert(1, 1, new int{1});
+  EXPECT_GE(q.last_updated(0), before);
+  EXPECT_LE(q.last_updated(0), relative_time::instance().get_msec());
+  EXPECT_EQ(q.last_updated(7), 0);
+  
+  // the reader of the abandoned block gets it well before its timeout
+  relative_time rt;
+  auto row = q.get(0, 20000);
+  EXPECT_EQ(row.second, 1);
+  EXPECT_EQ(*row.first[0], 0);
+  EXPECT_LT(rt.get_msec(), 10000);
+  EXPECT_EQ(q.missing_columns(0), 2);
+  EXPECT_EQ(q.usage().n_expired_, 1);
+  
+  // complete blocks are kept for their readers
+  EXPECT_EQ(q.get(1, 1).second, 2);
+  EXPECT_EQ(q.expire_stale(0), 0);
+}
+
+TEST_F(UtilTableCollectorTest, InsertBatch)
+{
+  typedef table_collector<int> collector;
+  table_collector_options options;
+  options.n_stripes_ = 3;
+  collector q(4, options);
+  
+  std::vector<std::shared_ptr<int>> cols{std::make_shared<int>(1),
+                                         std::make_shared<int>(2),
+                                         std::make_shared<int>(3)};
+  q.insert_columns(0, 1, cols.begin(), cols.end());
+  EXPECT_EQ(q.missing_column_ids(0), (std::vector<size_t>{0}));
+  EXPECT_THROW(q.insert_columns(1, 2, cols.begin(), cols.end()), std::exception);
+  
+  auto reader = std::async(std::launch::async, [&q] { return q.get(5, 20000).second; });
+  
+  // all four columns of blocks 1..9, plus the last one of block 0
+  std::vector<collector::cell> cells;
+  cells.push_back(collector::cell{0, 0, std::make_shared<int>(0)});
+  for( size_t b=1; b<10; ++b )
+    for( size_t c=0; c<4; ++c )
+      cells.push_back(collector::cell{b, c, std::make_shared<int>((int)(b*10+c))});
+  q.insert_batch(cells);
+  EXPECT_TRUE(cells.empty());
+  
+  EXPECT_EQ(reader.get(), 4);
+  for( size_t b=0; b<10; ++b )
+    EXPECT_EQ(q.missing_columns(b), 0);
+  EXPECT_EQ(*q.get(7, 1).first[2], 72);
+  EXPECT_EQ(*q.get(0, 1).first[3], 3);
+  EXPECT_EQ(q.max_block_id(), 9);
+  EXPECT_EQ(q.usage().n_blocks_, 10);
+}
+
+TEST_F(UtilTableCollectorTest, Scan)
+{
+  typedef table_collector<int> collector;
+  collector q(2);
+  
+  // blocks complete out of order
+  std::thread producer([&q] {
+    for( size_t i : {3, 1, 0, 2, 5, 4, 7, 6, 9, 8} )
+    {
+      q.insert(i, 1, new int{(int)i});
+      q.insert(i, 0, new int{(int)i});
+    }
+  });
+  
+  auto sc = q.scan(0, 10);
+  std::vector<size_t> ids;
+  size_t block_id = 0;
+  collector::row_data row;
+  while( sc.next(block_id, row, 20000) )
+  {
+    EXPECT_EQ(*row[0], (int)block_id);
+    ids.push_back(block_id);
+  }
+  producer.join();
+  
+  EXPECT_TRUE(sc.at_end());
+  EXPECT_EQ(ids, (std::vector<size_t>{0,1,2,3,4,5,6,7,8,9}));
+  EXPECT_EQ(q.usage().n_blocks_, 0);
+  
+  // readiness look ahead, without taking the blocks
+  q.insert(10, 0, new int{0});
+  q.insert(10, 1, new int{0});
+  q.insert(11, 0, new int{0});
+  q.insert(11, 1, new int{0});
+  q.insert(13, 0, new int{0});
+  q.insert(13, 1, new int{0});
+  auto peek = q.scan(10, 20, false);
+  EXPECT_EQ(peek.ready_ahead(5), 2);
+  EXPECT_EQ(peek.ready_ahead(1), 1);
+  EXPECT_TRUE(peek.next(block_id, row, 1));
+  EXPECT_TRUE(peek.next(block_id, row, 1));
+  EXPECT_FALSE(peek.next(block_id, row, 1));
+  EXPECT_EQ(peek.position(), 12);
+  EXPECT_EQ(q.usage().n_blocks_, 3);
+}
+
+TEST_F(UtilTableCollectorTest, ScanDroppedBlocks)
+{
+  typedef table_collector<int> collector;
+  collector q(2);
+  for( size_t i : {0, 2} )
+  {
+    q.insert(i, 0, new int{(int)i});
+    q.insert(i, 1, new int{(int)i});
+  }
+  q.insert(1, 0, new int{1});
+  
+  auto sc = q.scan(0, 5);
+  size_t block_id = 0;
+  collector::row_data row;
+  EXPECT_TRUE(sc.next(block_id, row, 1));
+  EXPECT_EQ(sc.status(), scan_status::ready);
+  
+  // expired before the scan got there: missing till skipped
+  EXPECT_EQ(q.expire_stale(0), 1);
+  EXPECT_FALSE(sc.next(block_id, row, 1));
+  EXPECT_EQ(sc.status(), scan_status::missing);
+  EXPECT_EQ(sc.position(), 1);
+  sc.skip();
+  EXPECT_TRUE(sc.next(block_id, row, 1));
+  EXPECT_EQ(block_id, 2);
+  
+  // expired while waiting: the partial block comes back, the scan goes on
+  q.insert(3, 1, new int{3});
+  auto reaper = std::async(std::launch::async, [&q] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return q.expire_stale(0);
+  });
+  EXPECT_FALSE(sc.next(block_id, row, 20000));
+  EXPECT_EQ(sc.status(), scan_status::dropped);
+  EXPECT_EQ(block_id, 3);
+  EXPECT_EQ(*row[1], 3);
+  EXPECT_EQ(reaper.get(), 1);
+  
+  q.insert(4, 0, new int{4});
+  EXPECT_FALSE(sc.next(block_id, row, 1));
+  EXPECT_EQ(sc.status(), scan_status::incomplete);
+  sc.skip();
+  EXPECT_FALSE(sc.next(block_id, row, 1));
+  EXPECT_EQ(sc.status(), scan_status::end);
+}
+
+TEST_F(UtilTableCollectorTest, AdmissionWindow)
+{
+  typedef table_collector<int> collector;
+  table_collector_options opts;
+  opts.admission_window_ = 4;
+  collector q(2, opts);
+  
+  // the producer runs ahead on column 0 and stalls at the window
+  std::atomic<size_t> n_inserted{0};
+  std::thread producer([&q,&n_inserted] {
+    for( size_t i=0; i<10; ++i )
+    {
+      q.insert(i, 0, new int{(int)i});
+      ++n_inserted;
+    }
+  });
+  
+  while( n_inserted < 4 )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(n_inserted, 4);
+  EXPECT_EQ(q.max_block_id(), 3);
+  EXPECT_EQ(q.lowest_incomplete(), 0);
+  
+  // completing out of order only moves the window on a gap fill
+  q.insert(1, 1, new int{1});
+  EXPECT_EQ(q.lowest_incomplete(), 0);
+  q.insert(0, 1, new int{0});
+  EXPECT_EQ(q.lowest_incomplete(), 2);
+  
+  // erasing an incomplete block frees its slot too
+  for( size_t i=2; i<10; ++i )
+  {
+    while( n_inserted <= i )
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    q.erase(i);
+  }
+  producer.join();
+  EXPECT_EQ(n_inserted, 10);
+  EXPECT_EQ(q.lowest_incomplete(), 10);
+}
+
+TEST_F(UtilTableCollectorTest, AdmissionWindowTimeout)
+{
+  typedef table_collector<int> collector;
+  table_collector_options opts;
+  opts.admission_window_ = 2;
+  opts.block_timeout_ms_ = 20;
+  collector q(2, opts);
+  
+  q.insert(0, 0, new int{0});
+  q.insert(1, 0, new int{1});
+  EXPECT_THROW(q.insert(2, 0, new int{2}), std::exception);
+  
+  // batches stop at the window edge and go on once it moves
+  std::vector<collector::cell> cells;
+  cells.push_back({0, 1, collector::item_sptr{new int{0}}});
+  cells.push_back({2, 0, collector::item_sptr{new int{2}}});
+  cells.push_back({2, 1, collector::item_sptr{new int{2}}});
+  q.insert_batch(cells);
+  EXPECT_EQ(q.lowest_incomplete(), 1);
+  EXPECT_TRUE(q.ready(2));
+  
+  // a batch failing at the window edge still hands over what completed
+  // and keeps the cells it did not apply
+  opts.admission_window_ = 1;
+  collector p(2, opts);
+  std::vector<size_t> ids;
+  p.on_complete([&ids](size_t block_id, collector::row_data &&) {
+                  ids.push_back(block_id);
+                },
+                true);
+  cells.clear();
+  cells.push_back({0, 0, collector::item_sptr{new int{0}}});
+  cells.push_back({0, 1, collector::item_sptr{new int{0}}});
+  cells.push_back({2, 0, collector::item_sptr{new int{2}}});
+  EXPECT_THROW(p.insert_batch(cells), std::exception);
+  EXPECT_EQ(ids, (std::vector<size_t>{0}));
+  ASSERT_EQ(cells.size(), 1);
+  EXPECT_EQ(cells[0].block_id_, 2);
+  EXPECT_EQ(*cells[0].item_, 2);
+}
+
+namespace
+{
+  struct counted
+  {
+    static std::atomic<int> n_alive_;
+    int value_;
+    
+    counted(int v) : value_(v) { ++n_alive_; }
+    counted(const counted & o) : value_(o.value_) { ++n_alive_; }
+    ~counted() { --n_alive_; }
+  };
+  
+  std::atomic<int> counted::n_alive_{0};
+}
+
+TEST_F(UtilTableCollectorTest, InsertValue)
+{
+  typedef table_collector<counted> collector;
+  {
+    collector q(3);
+    q.insert_value(0, 0, 10);
+    q.insert_value(0, 1, counted{11});
+    q.insert(0, 2, new counted{12});
+    auto ret = q.get(0, 0);
+    ASSERT_EQ(ret.second, 3);
+    EXPECT_EQ(ret.first[0]->value_, 10);
+    EXPECT_EQ(ret.first[1]->value_, 11);
+    EXPECT_EQ(ret.first[2]->value_, 12);
+    
+    // the arena cells share one control block
+    EXPECT_FALSE(ret.first[0].owner_before(ret.first[1]));
+    EXPECT_FALSE(ret.first[1].owner_before(ret.first[0]));
+    EXPECT_TRUE(ret.first[0].owner_before(ret.first[2]) ||
+                ret.first[2].owner_before(ret.first[0]));
+    
+    // setting a column again does not touch the handed out item
+    q.insert_value(0, 0, 20);
+    EXPECT_EQ(ret.first[0]->value_, 10);
+    EXPECT_EQ(q.get(0, 0).first[0]->value_, 20);
+    
+    // a cell handed out keeps the arena after the block is gone
+    collector::item_sptr keep = ret.first[1];
+    ret.first.clear();
+    q.erase(0);
+    EXPECT_EQ(keep->value_, 11);
+    EXPECT_EQ(counted::n_alive_, 2);
+  }
+  EXPECT_EQ(counted::n_alive_, 0);
+}
+
 UtilActiveQueueTest::UtilActiveQueueTest()
 : value_(0),
 queue_(10,[this](int v){ value_ += v; })
@@ -309,6 +1017,523 @@ TEST_F(UtilActiveQueueTest, Stop3Times)
   EXPECT_TRUE( this->queue_.stopped() );
 }
 
+namespace
+{
+  template <template <typename> class STORAGE>
+  uint64_t queue_throughput(size_t capacity)
+  {
+    const int n_producers = 4;
+    const int n_items     = 50000;
+    std::atomic<uint64_t> sum{0};
+    active_queue<int,100,STORAGE> q{
+      10,
+      [&sum](int v) { sum += v; },
+      capacity};
+    
+    relative_time rt;
+    std::vector<std::thread> producers;
+    for( int p=0; p<n_producers; ++p )
+    {
+      producers.push_back(std::thread{[&q,n_items](){
+        for( int i=1; i<=n_items; ++i )
+          q.push(i);
+      }});
+    }
+    for( auto & t : producers )
+      t.join();
+    EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+    uint64_t took = rt.get_usec();
+    EXPECT_EQ( sum, n_producers*(((uint64_t)n_items*(n_items+1))/2) );
+    return took;
+  }
+}
+
+TEST_F(UtilActiveQueueTest, RingBuffer)
+{
+  std::atomic<int> value{0};
+  // tiny capacity, so producers have to wait for the workers
+  active_queue<int,100,mpmc_ring> q{
+    4,
+    [&value](int v) { value += v; },
+    8};
+  for( int i=1; i<=10000; ++i )
+    q.push(i);
+  EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  EXPECT_EQ( q.n_enqueued(), 10000 );
+  EXPECT_EQ( q.n_done(), 10000 );
+  EXPECT_EQ( value, 50005000 );
+}
+
+TEST_F(UtilActiveQueueTest, StorageThroughput)
+{
+  uint64_t locked   = queue_throughput<locked_queue>(0);
+  uint64_t lockfree = queue_throughput<mpmc_ring>(65536);
+  uint64_t stealing = queue_throughput<work_stealing_queue>(0);
+  std::cout << "locked_queue: " << locked << " usec, "
+            << "mpmc_ring: " << lockfree << " usec, "
+            << "work_stealing_queue: " << stealing << " usec\n";
+}
+
+TEST_F(UtilActiveQueueTest, WorkStealingFanOut)
+{
+  // every item below 1024 spawns two children, like a recursive split
+  std::atomic<int> leaves{0};
+  typedef active_queue<int,100,work_stealing_queue> ws_queue;
+  std::unique_ptr<ws_queue> q;
+  q.reset(new ws_queue{
+    4,
+    [&](int v) {
+      if( v < 1024 )
+      {
+        q->push(2*v);
+        q->push(2*v+1);
+      }
+      else
+      {
+        ++leaves;
+      }
+    }});
+  {
+    MEASURE_ME;
+    q->push(1);
+    EXPECT_TRUE( q->wait_empty(std::chrono::milliseconds(20000)) );
+  }
+  EXPECT_EQ( leaves, 1024 );
+  EXPECT_EQ( q->n_done(), 2047 );
+}
+
+TEST_F(UtilActiveQueueTest, PushBulk)
+{
+  std::vector<int> items;
+  for( int i=1; i<=10000; ++i )
+    items.push_back(i);
+  
+  this->queue_.push_bulk(items.begin(), items.end());
+  EXPECT_EQ( items.size(), 10000 );
+  this->queue_.push_bulk(std::move(items));
+  EXPECT_TRUE( items.empty() );
+  EXPECT_TRUE( this->queue_.wait_empty(std::chrono::milliseconds(20000)) );
+  EXPECT_EQ( this->queue_.n_enqueued(), 20000 );
+  EXPECT_EQ( this->value_, 2*50005000 );
+}
+
+TEST_F(UtilActiveQueueTest, BatchHandler)
+{
+  std::atomic<int> value{0};
+  std::atomic<size_t> calls{0};
+  std::atomic<size_t> largest{0};
+  active_queue<int,100> q{
+    4,
+    [&](std::vector<int> & batch) {
+      int sum = 0;
+      for( auto v : batch ) sum += v;
+      value += sum;
+      ++calls;
+      if( batch.size() > largest ) largest = batch.size();
+    },
+    64};
+  
+  std::vector<int> items;
+  for( int i=1; i<=10000; ++i )
+    items.push_back(i);
+  {
+    MEASURE_ME;
+    q.push_bulk(std::move(items));
+    EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  }
+  EXPECT_EQ( q.n_done(), 10000 );
+  EXPECT_EQ( value, 50005000 );
+  EXPECT_LE( largest, 64 );
+  EXPECT_LT( calls, 10000 );
+}
+
+namespace
+{
+  // a single worker queue whose handler waits till the gate opens
+  struct gated_queue
+  {
+    std::promise<void>           gate_;
+    std::shared_future<void>     opened_;
+    std::vector<int>             seen_;
+    std::mutex                   mtx_;
+    active_queue<int,100>        queue_;
+    
+    gated_queue(const active_queue_options & options)
+    : opened_(gate_.get_future().share()),
+      queue_(1, [this](int v) {
+        opened_.wait();
+        std::lock_guard<std::mutex> l(mtx_);
+        seen_.push_back(v);
+      }, options) {}
+    
+    // push one item and wait till the worker has taken it
+    void occupy_worker()
+    {
+      EXPECT_TRUE( queue_.push(0) );
+      while( queue_.size() > 0 )
+        std::this_thread::yield();
+    }
+    
+    void open() { gate_.set_value(); }
+  };
+}
+
+TEST_F(UtilActiveQueueTest, CapacityReject)
+{
+  gated_queue g{active_queue_options(4, queue_overflow::reject)};
+  g.occupy_worker();
+  for( int i=1; i<=4; ++i )
+    EXPECT_TRUE( g.queue_.push(i) );
+  EXPECT_FALSE( g.queue_.push(5) );
+  std::vector<int> more{5,6};
+  EXPECT_EQ( g.queue_.push_bulk(std::move(more)), 0 );
+  EXPECT_EQ( g.queue_.size(), 4 );
+  EXPECT_EQ( g.queue_.high_water_mark(), 4 );
+  EXPECT_EQ( g.queue_.n_enqueued(), 5 );
+  g.open();
+  EXPECT_TRUE( g.queue_.wait_empty(std::chrono::milliseconds(1000)) );
+  EXPECT_EQ( g.seen_, std::vector<int>({0,1,2,3,4}) );
+}
+
+TEST_F(UtilActiveQueueTest, CapacityDropOldest)
+{
+  gated_queue g{active_queue_options(2, queue_overflow::drop_oldest)};
+  g.occupy_worker();
+  for( int i=1; i<=5; ++i )
+    EXPECT_TRUE( g.queue_.push(i) );
+  EXPECT_EQ( g.queue_.size(), 2 );
+  EXPECT_EQ( g.queue_.n_dropped(), 3 );
+  g.open();
+  EXPECT_TRUE( g.queue_.wait_empty(std::chrono::milliseconds(1000)) );
+  EXPECT_EQ( g.queue_.n_done(), 6 );
+  EXPECT_EQ( g.seen_, std::vector<int>({0,4,5}) );
+}
+
+TEST_F(UtilActiveQueueTest, CapacityBlock)
+{
+  gated_queue g{active_queue_options(2, queue_overflow::block, 100)};
+  g.occupy_worker();
+  EXPECT_TRUE( g.queue_.push(1) );
+  EXPECT_TRUE( g.queue_.push(2) );
+  {
+    relative_time rt;
+    EXPECT_FALSE( g.queue_.push(3) );
+    EXPECT_GE( rt.get_msec(), 100 );
+  }
+  std::thread opener{[&g](){
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    g.open();
+  }};
+  // blocks till the worker makes room
+  EXPECT_TRUE( g.queue_.push(3) );
+  opener.join();
+  EXPECT_TRUE( g.queue_.wait_empty(std::chrono::milliseconds(1000)) );
+  EXPECT_EQ( g.seen_, std::vector<int>({0,1,2,3}) );
+  EXPECT_LE( g.queue_.high_water_mark(), 2 );
+}
+
+TEST_F(UtilActiveQueueTest, PriorityLanes)
+{
+  active_queue_options options;
+  options.n_lanes_ = 2;
+  gated_queue g{options};
+  g.occupy_worker();
+  for( int i=10; i<15; ++i )
+    EXPECT_TRUE( g.queue_.push(i) );
+  EXPECT_TRUE( g.queue_.push(20, 1) );
+  EXPECT_TRUE( g.queue_.push(21, 1) );
+  EXPECT_THROW( g.queue_.push(30, 2), virtdb::utils::exception );
+  EXPECT_EQ( g.queue_.n_lanes(), 2 );
+  EXPECT_EQ( g.queue_.n_enqueued(0), 6 );
+  EXPECT_EQ( g.queue_.n_enqueued(1), 2 );
+  g.open();
+  EXPECT_TRUE( g.queue_.wait_empty(std::chrono::milliseconds(1000)) );
+  EXPECT_EQ( g.seen_, std::vector<int>({0,20,21,10,11,12,13,14}) );
+  EXPECT_EQ( g.queue_.n_done(0), 6 );
+  EXPECT_EQ( g.queue_.n_done(1), 2 );
+}
+
+TEST_F(UtilActiveQueueTest, WeightedLanes)
+{
+  active_queue_options options;
+  options.n_lanes_      = 2;
+  options.lane_weights_ = {1, 3};
+  gated_queue g{options};
+  g.occupy_worker();
+  for( int i=0; i<4; ++i )
+  {
+    EXPECT_TRUE( g.queue_.push(10+i, 0) );
+    EXPECT_TRUE( g.queue_.push(20+i, 1) );
+  }
+  g.open();
+  EXPECT_TRUE( g.queue_.wait_empty(std::chrono::milliseconds(1000)) );
+  EXPECT_EQ( g.seen_, std::vector<int>({0,20,21,22,10,23,11,12,13}) );
+}
+
+TEST_F(UtilActiveQueueTest, KeyedOrder)
+{
+  const int n_keys  = 16;
+  const int n_items = 2000;
+  std::vector<int> last(n_keys, -1);
+  std::unique_ptr<std::atomic<bool> []> running{new std::atomic<bool>[n_keys]};
+  for( int k=0; k<n_keys; ++k ) running[k] = false;
+  std::atomic<int> out_of_order{0};
+  std::atomic<int> overlapped{0};
+  
+  active_queue<int,100> q{
+    8,
+    [&](int v) {
+      int key = v / n_items;
+      int seq = v % n_items;
+      if( running[key].exchange(true) ) ++overlapped;
+      if( last[key]+1 != seq ) ++out_of_order;
+      last[key] = seq;
+      running[key] = false;
+    }};
+  
+  {
+    MEASURE_ME;
+    for( int i=0; i<n_items; ++i )
+      for( int k=0; k<n_keys; ++k )
+        EXPECT_TRUE( q.push_keyed(k, k*n_items+i) );
+    EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  }
+  EXPECT_EQ( q.n_done(), n_keys*n_items );
+  EXPECT_EQ( out_of_order, 0 );
+  EXPECT_EQ( overlapped, 0 );
+  for( int k=0; k<n_keys; ++k )
+    EXPECT_EQ( last[k], n_items-1 );
+}
+
+namespace
+{
+  struct copy_counter
+  {
+    static std::atomic<int> copies_;
+    int value_;
+    
+    copy_counter(int v=0) : value_(v) {}
+    copy_counter(const copy_counter & o) : value_(o.value_) { ++copies_; }
+    copy_counter(copy_counter && o) = default;
+    copy_counter & operator=(const copy_counter & o)
+    {
+      value_ = o.value_;
+      ++copies_;
+      return *this;
+    }
+    copy_counter & operator=(copy_counter && o) = default;
+  };
+  
+  std::atomic<int> copy_counter::copies_{0};
+}
+
+TEST_F(UtilActiveQueueTest, InlineHandler)
+{
+  std::atomic<int> value{0};
+  copy_counter::copies_ = 0;
+  {
+    auto q = make_active_queue<copy_counter>(4, [&value](copy_counter && c) {
+      value += c.value_;
+    });
+    for( int i=1; i<=10000; ++i )
+      q->push(copy_counter{i});
+    EXPECT_TRUE( q->wait_empty(std::chrono::milliseconds(20000)) );
+  }
+  EXPECT_EQ( value, 50005000 );
+  EXPECT_EQ( copy_counter::copies_, 0 );
+  
+  // handlers taking a non-const reference are supported too
+  value = 0;
+  {
+    auto q = make_active_queue<copy_counter>(4, [&value](copy_counter & c) {
+      value += c.value_;
+    });
+    for( int i=1; i<=100; ++i )
+      q->push(copy_counter{i});
+    EXPECT_TRUE( q->wait_empty(std::chrono::milliseconds(20000)) );
+  }
+  EXPECT_EQ( value, 5050 );
+  EXPECT_EQ( copy_counter::copies_, 0 );
+  
+  // the type erased handler now gets the item moved in
+  {
+    active_queue<copy_counter,100> q{4, [&value](copy_counter c) { value += c.value_; }};
+    for( int i=1; i<=100; ++i )
+      q.push(copy_counter{i});
+    EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  }
+  EXPECT_EQ( copy_counter::copies_, 0 );
+}
+
+TEST_F(UtilActiveQueueTest, LazyStart)
+{
+  active_queue_options options;
+  options.lazy_start_ = true;
+  std::vector<std::unique_ptr<active_queue<int,100>>> queues;
+  std::atomic<int> value{0};
+  for( int i=0; i<100; ++i )
+  {
+    queues.push_back(std::unique_ptr<active_queue<int,100>>{
+      new active_queue<int,100>(4, [&value](int v) { value += v; }, options)});
+    EXPECT_EQ( queues.back()->n_threads(), 0 );
+  }
+  
+  queues[0]->push(1);
+  EXPECT_EQ( queues[0]->n_threads(), 4 );
+  EXPECT_EQ( queues[1]->n_threads(), 0 );
+  EXPECT_TRUE( queues[0]->wait_empty(std::chrono::milliseconds(1000)) );
+  EXPECT_EQ( value, 1 );
+}
+
+TEST_F(UtilActiveQueueTest, ElasticThreads)
+{
+  active_queue_options options;
+  options.max_threads_ = 4;
+  options.grow_depth_  = 2;
+  options.idle_ms_     = 50;
+  std::atomic<int> value{0};
+  active_queue<int,100> q{
+    1,
+    [&value](int v) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      value += v;
+    },
+    options};
+  EXPECT_EQ( q.n_threads(), 1 );
+  
+  for( int i=1; i<=100; ++i )
+    q.push(i);
+  EXPECT_EQ( q.n_threads(), 4 );
+  EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  EXPECT_EQ( value, 5050 );
+  
+  // the extra workers retire, the minimum stays
+  relative_time rt;
+  while( q.n_threads() > 1 && rt.get_msec() < 5000 )
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ( q.n_threads(), 1 );
+  
+  // the pool grows again when needed
+  for( int i=1; i<=100; ++i )
+    q.push(i);
+  EXPECT_GT( q.n_threads(), 1 );
+  EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  EXPECT_EQ( value, 2*5050 );
+  q.stop();
+  EXPECT_EQ( q.n_threads(), 0 );
+}
+
+TEST_F(UtilActiveQueueTest, ElasticFromZero)
+{
+  active_queue_options options;
+  options.max_threads_ = 1;
+  options.idle_ms_     = 1;
+  std::atomic<int> value{0};
+  active_queue<int,100> q{
+    0,
+    [&value](int v) { value += v; },
+    options};
+  EXPECT_EQ( q.n_threads(), 0 );
+  
+  // pushes land while the only worker is idle or retiring
+  for( int i=1; i<=1000; ++i )
+  {
+    q.push(i);
+    ASSERT_TRUE( q.wait_empty(std::chrono::milliseconds(2000)) );
+    std::this_thread::sleep_for(std::chrono::microseconds(900+(i%8)*50));
+  }
+  EXPECT_EQ( value, 1000*1001/2 );
+}
+
+TEST_F(UtilActiveQueueTest, ElasticTeardown)
+{
+  // stop() races the idle workers retiring
+  active_queue_options options;
+  options.max_threads_ = 2;
+  options.grow_depth_  = 0;
+  options.idle_ms_     = 1;
+  for( int i=0; i<10000; ++i )
+  {
+    std::atomic<int> value{0};
+    active_queue<int,100> q{
+      0,
+      [&value](int v) { value += v; },
+      options};
+    q.push(1);
+    q.push(2);
+    ASSERT_TRUE( q.wait_empty(std::chrono::milliseconds(2000)) );
+    if( i%4 == 0 )
+      std::this_thread::sleep_for(std::chrono::microseconds(900+(i%9)*25));
+  }
+}
+
+TEST_F(UtilActiveQueueTest, Instrumented)
+{
+  instrumented_active_queue<int> q{
+    2,
+    [](int v) {
+      if( v == 7 ) throw std::runtime_error("seven");
+      if( v%10 == 0 ) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }};
+  
+  for( int i=0; i<100; ++i )
+    q.push(i);
+  std::vector<int> more{100, 101, 102};
+  q.push_bulk(more.begin(), more.end());
+  EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  
+  active_queue_stats st = q.stats();
+  EXPECT_EQ( st.n_enqueued_, 103 );
+  EXPECT_EQ( st.n_done_, 103 );
+  EXPECT_EQ( st.n_exceptions_, 1 );
+  EXPECT_EQ( st.size_, 0 );
+  EXPECT_GT( st.high_water_mark_, 0 );
+  EXPECT_EQ( st.wait_us_.count_, 103 );
+  EXPECT_EQ( st.handler_us_.count_, 103 );
+  EXPECT_GE( st.handler_us_.max_, 2000 );
+  EXPECT_GE( st.handler_us_.percentile(1.0), 2000 );
+  ASSERT_EQ( st.workers_.size(), 2 );
+  
+  uint64_t handled = 0;
+  for( auto & w : st.workers_ )
+  {
+    handled += w.n_handled_;
+    EXPECT_LE( w.busy_ratio(), 1.0 );
+  }
+  EXPECT_EQ( handled, 103 );
+  EXPECT_GT( st.workers_[0].busy_us_ + st.workers_[1].busy_us_, 20000 );
+  
+  // plain queues only count
+  active_queue<int,100> plain{1, [](int) { throw 1; }};
+  plain.push(1);
+  EXPECT_TRUE( plain.wait_empty(std::chrono::milliseconds(20000)) );
+  st = plain.stats();
+  EXPECT_EQ( st.n_exceptions_, 1 );
+  EXPECT_EQ( st.handler_us_.count_, 0 );
+  EXPECT_TRUE( st.workers_.empty() );
+}
+
+TEST_F(UtilActiveQueueTest, InstrumentedBatch)
+{
+  std::atomic<int> value{0};
+  instrumented_active_queue<int> q{
+    1,
+    [&value](std::vector<int> & items) {
+      for( auto i : items ) value += i;
+    },
+    8};
+  
+  for( int i=1; i<=100; ++i )
+    q.push(i);
+  EXPECT_TRUE( q.wait_empty(std::chrono::milliseconds(20000)) );
+  EXPECT_EQ( value, 5050 );
+  
+  active_queue_stats st = q.stats();
+  EXPECT_EQ( st.wait_us_.count_, 100 );
+  EXPECT_LE( st.handler_us_.count_, 100 );
+  EXPECT_EQ( st.workers_[0].n_handled_, 100 );
+}
+
 UtilBarrierTest::UtilBarrierTest() : barrier_(10) {}
 
 TEST_F(UtilBarrierTest, BarrierReady)
@@ -347,6 +1572,144 @@ TEST_F(UtilBarrierTest, BarrierReady)
   EXPECT_EQ(flag, 9);
 }
 
+TEST_F(UtilParkerTest, UnparkAll)
+{
+  parker p;
+  std::atomic<bool> ready{false};
+  std::atomic<int> woken{0};
+  std::vector<std::thread> threads;
+  
+  for( int i=0; i<4; ++i )
+  {
+    threads.push_back(std::thread{[&](){
+      while( true )
+      {
+        parker::ticket t = p.prepare_park();
+        if( ready )
+        {
+          p.cancel_park();
+          break;
+        }
+        p.park(t);
+      }
+      ++woken;
+    }});
+  }
+  
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ( woken, 0 );
+  ready = true;
+  p.unpark_all();
+  for( auto & t : threads )
+    t.join();
+  EXPECT_EQ( woken, 4 );
+  EXPECT_EQ( p.waiting(), 0 );
+}
+
+TEST_F(UtilParkerTest, ParkUntil)
+{
+  parker p;
+  relative_time rt;
+  parker::ticket t = p.prepare_park();
+  EXPECT_FALSE( p.park_until(t, std::chrono::steady_clock::now() +
+                                std::chrono::milliseconds(100)) );
+  EXPECT_GE( rt.get_msec(), 100 );
+  EXPECT_EQ( p.waiting(), 0 );
+  
+  // an unpark between prepare and park must not be lost
+  t = p.prepare_park();
+  p.unpark_one();
+  EXPECT_TRUE( p.park_until(t, std::chrono::steady_clock::now() +
+                               std::chrono::milliseconds(10000)) );
+}
+
+TEST_F(UtilHistogramTest, Buckets)
+{
+  EXPECT_EQ( log_histogram::bucket_of(0), 0 );
+  EXPECT_EQ( log_histogram::bucket_of(1), 1 );
+  EXPECT_EQ( log_histogram::bucket_of(3), 2 );
+  EXPECT_EQ( log_histogram::bucket_of(4), 3 );
+  EXPECT_EQ( log_histogram::bucket_of(~uint64_t{0}), 64 );
+  
+  log_histogram h;
+  for( uint64_t i=1; i<=100; ++i )
+    h.record(i);
+  h.record(5000);
+  
+  log_histogram::snapshot s = h.get();
+  EXPECT_EQ( s.count_, 101 );
+  EXPECT_EQ( s.max_, 5000 );
+  EXPECT_EQ( s.sum_, 5050+5000 );
+  EXPECT_EQ( s.percentile(0.5), 63 );
+  EXPECT_EQ( s.percentile(0.99), 127 );
+  EXPECT_EQ( s.percentile(1.0), 5000 );
+  
+  h.reset();
+  EXPECT_EQ( h.get().count_, 0 );
+}
+
+TEST_F(UtilBlockWindowTest, Basic)
+{
+  block_window<int> w(64);
+  for( int i=10; i<50; ++i )
+    EXPECT_TRUE( w.emplace(i, i).second );
+  EXPECT_FALSE( w.emplace(20, 0).second );
+  EXPECT_EQ( *w.find(20), 20 );
+  
+  // beyond the window and below the base
+  w.emplace(1000, 1000);
+  w.emplace(5, 5);
+  EXPECT_EQ( w.size(), 42 );
+  EXPECT_EQ( *w.find(1000), 1000 );
+  EXPECT_EQ( *w.find(5), 5 );
+  EXPECT_EQ( w.find(51), nullptr );
+  
+  // erasing from the bottom slides the window up
+  for( int i=10; i<40; ++i )
+    EXPECT_TRUE( w.erase(i) );
+  EXPECT_FALSE( w.erase(10) );
+  w.emplace(100, 100);
+  EXPECT_EQ( *w.find(100), 100 );
+  
+  std::vector<size_t> ids;
+  w.for_each([&ids](size_t id, int & v) {
+    EXPECT_EQ( (int)id, v );
+    ids.push_back(id);
+  });
+  EXPECT_EQ( ids.size(), w.size() );
+  EXPECT_TRUE( std::is_sorted(ids.begin(), ids.end()) );
+  EXPECT_EQ( ids.front(), 5 );
+  EXPECT_EQ( ids.back(), 1000 );
+}
+
+TEST_F(UtilBlockWindowTest, MapValuesMoveToRing)
+{
+  block_window<int> w(64);
+  for( int i=0; i<64; ++i )
+    w.emplace(i, i);
+  w.emplace(100, 100);
+  
+  // sliding the base brings 100 into the window
+  for( int i=0; i<50; ++i )
+    w.erase(i);
+  EXPECT_FALSE( w.emplace(100, 0).second );
+  EXPECT_EQ( *w.find(100), 100 );
+  EXPECT_EQ( w.size(), 15 );
+  
+  // an emptied ring restarting below a map value
+  w.emplace(1000, 1000);
+  for( int i=50; i<64; ++i )
+    w.erase(i);
+  w.erase(100);
+  w.emplace(990, 990);
+  EXPECT_FALSE( w.emplace(1000, 0).second );
+  EXPECT_EQ( *w.find(1000), 1000 );
+  EXPECT_EQ( w.size(), 2 );
+  EXPECT_TRUE( w.erase(990) );
+  EXPECT_TRUE( w.erase(1000) );
+  EXPECT_TRUE( w.empty() );
+}
+
 TEST_F(UtilNetTest, DummyTest)
 {
   // TODO : NetTest
@@ -357,6 +1720,183 @@ TEST_F(UtilFlexAllocTest, DummyTest)
   // TODO : FlexAllocTest
 }
 
+TEST_F(UtilMempoolTest, GeometricGrowth)
+{
+  // fixed size chunks, many of them
+  {
+    mempool pool(64);
+    for( int i=0; i<100000; ++i )
+      pool.allocate<char>(64);
+    EXPECT_EQ( pool.n_chunks(), 100000 );
+    // iterative teardown of the long chain
+    pool.clear();
+    EXPECT_EQ( pool.n_chunks(), 1 );
+    EXPECT_EQ( pool.allocated_bytes(), 64 );
+    
+    // the first chunk is allocated from again
+    char * p = pool.allocate<char>(64);
+    p[63] = 1;
+    EXPECT_EQ( pool.n_chunks(), 1 );
+  }
+  
+  // doubling chunks up to 1MB
+  mempool pool(1024, 1024, 1024*1024);
+  while( pool.allocated_bytes() < 4*1024*1024 )
+  {
+    char * p = pool.allocate<char>(1024);
+    p[1023] = 1;
+  }
+  EXPECT_LE( pool.n_chunks(), 14 );
+  
+  // the tail stays the allocating chunk
+  int * a = pool.allocate<int>(4);
+  EXPECT_TRUE( pool.reuse<int>(a, 4) );
+  EXPECT_EQ( pool.allocate<int>(4), a );
+  
+  // a request above the current chunk size gets a chunk of its own
+  size_t chunks = pool.n_chunks();
+  char * big = pool.allocate<char>(2*1024*1024);
+  big[2*1024*1024-1] = 1;
+  EXPECT_EQ( pool.n_chunks(), chunks+1 );
+}
+
+TEST_F(UtilMempoolTest, Allocator)
+{
+  mempool pool(4096);
+  mempool_allocator<int> alloc(pool);
+  
+  std::vector<int, mempool_allocator<int>> v(alloc);
+  for( int i=0; i<1000; ++i ) v.push_back(i);
+  EXPECT_EQ( v[999], 999 );
+  EXPECT_GE( pool.allocated_bytes(), 1000*sizeof(int) );
+  
+  typedef std::basic_string<char, std::char_traits<char>, mempool_allocator<char>> pool_string;
+  pool_string str("a string that does not fit the small buffer", alloc);
+  EXPECT_EQ( str.size(), 43 );
+  
+  typedef mempool_allocator<std::pair<const int, int>> map_alloc;
+  std::map<int, int, std::less<int>, map_alloc> m{map_alloc(alloc)};
+  for( int i=0; i<100; ++i ) m[i] = i;
+  EXPECT_EQ( m.size(), 100 );
+  
+  // equality by pool
+  mempool other(4096);
+  EXPECT_TRUE( alloc == map_alloc(alloc) );
+  EXPECT_TRUE( alloc != mempool_allocator<int>(other) );
+  
+  // the last allocation is given back
+  int * p = alloc.allocate(10);
+  alloc.deallocate(p, 10);
+  EXPECT_EQ( alloc.allocate(10), p );
+  int * q = alloc.allocate(3);
+  alloc.deallocate(p, 10);
+  EXPECT_NE( alloc.allocate(3), q );
+  
+  // containers of the type being defined
+  struct node
+  {
+    std::vector<node, mempool_allocator<node>> children_;
+    explicit node(const mempool_allocator<node> & a) : children_(a) {}
+  };
+  node root{mempool_allocator<node>(pool)};
+  root.children_.emplace_back(root.children_.get_allocator());
+  root.children_[0].children_.emplace_back(root.children_.get_allocator());
+  EXPECT_EQ( root.children_[0].children_.size(), 1 );
+}
+
+TEST_F(UtilMempoolTest, SyncSizeClasses)
+{
+  EXPECT_EQ( sync_mempool::class_of(1), 0 );
+  EXPECT_EQ( sync_mempool::class_of(8), 0 );
+  EXPECT_EQ( sync_mempool::class_of(9), 1 );
+  EXPECT_EQ( sync_mempool::class_of(4096), 9 );
+  
+  sync_mempool pool(1024);
+  EXPECT_EQ( pool.chunk_size(), sync_mempool::max_class_size() );
+  
+  // freed memory is recycled by its size class
+  int * a = pool.allocate<int>(3);
+  pool.deallocate(a, 3);
+  EXPECT_EQ( pool.allocate<int>(4), a );
+  EXPECT_NE( pool.allocate<int>(3), a );
+  
+  // large requests bypass the chunks
+  size_t before = pool.allocated_bytes();
+  char * big = pool.allocate<char>(100000);
+  big[99999] = 1;
+  pool.deallocate(big, 100000);
+  EXPECT_EQ( pool.allocated_bytes(), before );
+}
+
+TEST_F(UtilMempoolTest, SyncThreads)
+{
+  sync_mempool pool(65536);
+  std::vector<std::thread> threads;
+  std::atomic<size_t> n_bad{0};
+  
+  // memory allocated by one thread and freed by another moves over
+  // the shared free lists
+  std::vector<size_t *> handoff[4];
+  for( size_t t=0; t<4; ++t )
+  {
+    threads.push_back(std::thread([&pool,&handoff,&n_bad,t] {
+      std::vector<size_t *> mine;
+      for( size_t i=0; i<10000; ++i )
+      {
+        size_t * p = pool.allocate<size_t>(1+i%16);
+        for( size_t j=0; j<1+i%16; ++j ) p[j] = t;
+        mine.push_back(p);
+      }
+      for( size_t i=0; i<mine.size(); ++i )
+      {
+        for( size_t j=0; j<1+i%16; ++j )
+          if( mine[i][j] != t ) ++n_bad;
+        if( i%2 ) pool.deallocate(mine[i], 1+i%16);
+        else handoff[t].push_back(mine[i]);
+      }
+    }));
+  }
+  for( auto & t : threads ) t.join();
+  
+  size_t before = pool.allocated_bytes();
+  for( size_t t=0; t<4; ++t )
+    for( size_t i=0; i<handoff[t].size(); ++i )
+      pool.deallocate(handoff[t][i], 1+(2*i)%16);
+  
+  // other threads reuse what this one gave back
+  std::thread([&pool] {
+    for( size_t i=0; i<1000; ++i )
+      pool.allocate<size_t>(1+i%16);
+  }).join();
+  
+  EXPECT_EQ( n_bad, 0 );
+  EXPECT_EQ( pool.allocated_bytes(), before );
+}
+
+TEST_F(UtilMempoolTest, SyncThreadExit)
+{
+  // exiting threads leave their chunk and free lists to the next ones
+  sync_mempool pool(65536);
+  for( int t=0; t<100; ++t )
+  {
+    std::thread([&pool] {
+      std::vector<size_t *> mine;
+      for( size_t i=0; i<100; ++i )
+        mine.push_back(pool.allocate<size_t>(1+i%16));
+      for( size_t i=0; i<mine.size(); ++i )
+        pool.deallocate(mine[i], 1+i%16);
+    }).join();
+  }
+  EXPECT_EQ( pool.allocated_bytes(), pool.chunk_size() );
+  
+  // a thread outliving pools does not keep them around
+  for( int i=0; i<100; ++i )
+  {
+    sync_mempool tmp(4096);
+    tmp.deallocate(tmp.allocate<int>(1), 1);
+  }
+}
+
 TEST_F(UtilAsyncWorkerTest, DestroyWithoutStart)
 {
   auto fun = [](void) {
@@ -3,13 +3,19 @@
     'utils_sources' :  [
                           'src/utils/constants.hh',          'src/utils/active_queue.hh',
                           'src/utils/flex_alloc.hh',         'src/utils/mempool.hh',
+                          'src/utils/mempool_allocator.hh',
+                          'src/utils/sync_mempool.cc',       'src/utils/sync_mempool.hh',
                           'src/utils/barrier.cc',            'src/utils/barrier.hh',
+                          'src/utils/parker.cc',             'src/utils/parker.hh',
+                          'src/utils/histogram.cc',          'src/utils/histogram.hh',
                           'src/utils/relative_time.cc',      'src/utils/relative_time.hh',
                           'src/utils/exception.hh',
                           'src/utils/net.cc',                'src/utils/net.hh',
                           'src/utils/hex_util.cc',           'src/utils/hex_util.hh',
                           'src/utils/async_worker.cc',       'src/utils/async_worker.hh',
-                          'src/utils/table_collector.hh',
+                          'src/utils/table_collector.hh',    'src/utils/block_window.hh',
+                          'src/utils/locked_queue.hh',       'src/utils/mpmc_ring.hh',
+                          'src/utils/work_stealing_queue.hh',
                           'src/utils/timer_service.cc',      'src/utils/timer_service.hh',
                           'src/utils/utf8.cc',               'src/utils/utf8.hh',
                         ],